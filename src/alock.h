@@ -37,6 +37,24 @@ enum aInputState {
     AINPUT_STATE_ERROR,
 };
 
+/* rectangle of the monitor within the X screen */
+struct aMonitor {
+    int x, y;
+    unsigned int width;
+    unsigned int height;
+};
+
+/* blur algorithms supported by the alock_blur_pixmap() */
+enum aBlurMode {
+    ABLUR_MODE_DEFAULT,
+    ABLUR_MODE_IMLIB,
+    ABLUR_MODE_GAUSS2D,
+    ABLUR_MODE_GAUSS,
+    ABLUR_MODE_BOX,
+    ABLUR_MODE_SCALE,
+    ABLUR_MODE__MAX,
+};
+
 
 /* module base interface */
 struct aModule {
@@ -55,6 +73,14 @@ struct aModuleAuth {
 struct aModuleBackground {
     struct aModule m;
     Window (*getwindow)(int screen);
+    /* Update the content of windows, which depends on the current state of
+     * the screen. This function is called right before every lock. */
+    int (*capture)(void);
+    /* Render the final content of windows. This function is called when the
+     * display is already locked, so windows shall be filled with a fallback
+     * color until then. Rendering should be abandoned when the deadline (the
+     * alock_mtime() time-stamp, zero for none) has passed. */
+    int (*render)(unsigned long deadline);
 };
 
 struct aModuleCursor {
@@ -67,6 +93,9 @@ struct aModuleInput {
     Window (*getwindow)(int screen);
     KeySym (*keypress)(KeySym key);
     void (*setstate)(enum aInputState state);
+    /* Get the time (in milliseconds) for which the input is ignored after
+     * the given number of consecutive authentication failures. */
+    unsigned int (*penalty)(unsigned int failures);
 };
 
 
@@ -125,17 +154,60 @@ void module_dummy_loadargs(const char *args);
 void module_dummy_loadxrdb(XrmDatabase database);
 int module_dummy_init(Display *display);
 void module_dummy_free(void);
+int module_dummy_capture(void);
+int module_dummy_render(unsigned long deadline);
 
 
 /* helper functions defined in utils.c */
 unsigned long alock_mtime(void);
+unsigned long long alock_utime(void);
+int alock_deadline_passed(Display *display, unsigned long deadline);
+int alock_parallel(unsigned int count,
+        int (*func)(unsigned int index, void *arg),
+        void *arg);
+void alock_parallel_threads(unsigned int threads);
+int alock_parallel_rows(XImage *image,
+        int x, int y,
+        unsigned int width,
+        unsigned int height,
+        int (*kernel)(XImage *image, int x, int y,
+            unsigned int width, unsigned int height, void *arg),
+        void *arg);
 int alock_native_byte_order(void);
+int alock_get_monitors(Display *display,
+        int screen,
+        struct aMonitor **monitors);
 int alock_alloc_color(Display *display,
         Colormap colormap,
         const char *color_name,
         const char *fallback_name,
         XColor *result);
+void alock_probe_extensions(Display *display);
 int alock_check_xrender(Display *display);
+int alock_check_xrender_version(Display *display, int major, int minor);
+int alock_local_connection(Display *display);
+int alock_check_xshm(Display *display);
+XImage *alock_create_image(Display *display,
+        Visual *visual,
+        int depth,
+        unsigned int width,
+        unsigned int height);
+void alock_destroy_image(Display *display, XImage *image);
+XImage *alock_get_image(Display *display,
+        Drawable drawable,
+        Visual *visual,
+        int depth,
+        int x, int y,
+        unsigned int width,
+        unsigned int height);
+void alock_put_image(Display *display,
+        Drawable drawable,
+        GC gc,
+        XImage *image,
+        int src_x, int src_y,
+        int dst_x, int dst_y,
+        unsigned int width,
+        unsigned int height);
 int alock_shade_pixmap(Display *display,
         Visual *visual,
         const Pixmap src_pm,
@@ -145,11 +217,35 @@ int alock_shade_pixmap(Display *display,
         int dst_x, int dst_y,
         unsigned int width,
         unsigned int height);
+int alock_tint_pixmap(Display *display,
+        Visual *visual,
+        Pixmap pixmap,
+        const XColor *color,
+        unsigned char shade,
+        int x, int y,
+        unsigned int width,
+        unsigned int height);
+int alock_scale_pixmap(Display *display,
+        Visual *visual,
+        const Pixmap src_pm,
+        unsigned int src_width,
+        unsigned int src_height,
+        Pixmap dst_pm,
+        int dst_x, int dst_y,
+        unsigned int dst_width,
+        unsigned int dst_height,
+        const char *filter);
+int alock_blur_mode(const char *name);
+unsigned int alock_blur_margin(enum aBlurMode mode,
+        unsigned char blur,
+        unsigned int levels);
 int alock_blur_pixmap(Display *display,
         Visual *visual,
         const Pixmap src_pm,
         Pixmap dst_pm,
+        enum aBlurMode mode,
         unsigned char blur,
+        unsigned int levels,
         int src_x, int src_y,
         int dst_x, int dst_y,
         unsigned int width,
@@ -158,5 +254,19 @@ int alock_grayscale_image(XImage *image,
         int x, int y,
         unsigned int width,
         unsigned int height);
+int alock_grayscale_pixmap(Display *display,
+        Visual *visual,
+        Pixmap pixmap,
+        int x, int y,
+        unsigned int width,
+        unsigned int height);
+
+/* tracing functions defined in trace.c */
+int alock_trace_open(const char *filename);
+void alock_trace_close(void);
+int alock_trace_enabled(void);
+void alock_trace_span(const char *category, const char *name,
+        unsigned long long start, const char *args, ...);
+void alock_trace_counter(const char *category, const char *name, long value);
 
 #endif /* ALOCK_ALOCK_H_ */
@@ -120,4 +120,6 @@ struct aModuleBackground alock_bg_blank = {
         module_free,
     },
     module_getwindow,
+    module_dummy_capture,
+    module_dummy_render,
 };
@@ -8,19 +8,31 @@
  * This project is licensed under the terms of the MIT license.
  *
  * This background module provides:
- *  -bg image:file=<file>,color=<color>,shade=<int>,scale,center,tiled
+ *  -bg image:file=<file>,color=<color>,shade=<int>,scale,center,tiled,
+ *            filter=<filter>
  *
  * Used resources:
  *  ALock.Background.Image.Color
  *  ALock.Background.Image.Shade
  *  ALock.Background.Image.Option
+ *  ALock.Background.Image.Filter
+ *
+ * Rendered backgrounds are cached in the $XDG_CACHE_HOME/alock directory,
+ * one entry per screen.
  *
  */
 
 #include "alock.h"
 
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <X11/Xutil.h>
 #include <Imlib2.h>
 
 
@@ -31,17 +43,71 @@ enum aImageOption {
     AIMAGE_OPTION_TILED,
 };
 
+/* Filters used for the server-side scaling. When no filter is specified,
+ * the image is scaled on the client side. */
+enum aImageFilter {
+    AIMAGE_FILTER_NONE = 0,
+    AIMAGE_FILTER_NEAREST,
+    AIMAGE_FILTER_BILINEAR,
+    AIMAGE_FILTER_BEST,
+};
+
+/* names of the X Render filters - see the aImageFilter enumeration */
+static const char *filter_names[] = {
+    [AIMAGE_FILTER_NONE] = NULL,
+    [AIMAGE_FILTER_NEAREST] = "nearest",
+    [AIMAGE_FILTER_BILINEAR] = "bilinear",
+    [AIMAGE_FILTER_BEST] = "best",
+};
+
+/* header of the cached background file, which is followed by the cache
+ * key and the raw image data */
+struct cacheHeader {
+    char magic[8];
+    uint32_t key_length;
+    uint32_t width;
+    uint32_t height;
+    uint32_t depth;
+    uint32_t bits_per_pixel;
+    uint32_t bytes_per_line;
+    uint32_t byte_order;
+    uint32_t data_offset;
+};
+
+#define CACHE_MAGIC "ALOCKBG2"
+
 static struct moduleData {
     Display *display;
     Pixmap *pixmaps;
     Window *windows;
+    /* per-monitor child windows used for the centered image */
+    Window **children;
+    struct aMonitor **monitors;
+    int *monitors_count;
+    /* cache keys of rendered backgrounds, which are pending for storing */
+    char **store_keys;
+    pthread_t store_thread;
+    int store_running;
+    XColor *colors;
     char *colorname;
     char *filename;
     unsigned int shade;
     enum aImageOption option;
+    enum aImageFilter filter;
 } data = { 0 };
 
 
+/* Get the image filter by its name. If the name is not recognized, -1 is
+ * returned. */
+static int get_filter(const char *name) {
+    int i;
+    for (i = AIMAGE_FILTER_NEAREST; i <= AIMAGE_FILTER_BEST; i++)
+        if (strcmp(name, filter_names[i]) == 0)
+            return i;
+    return -1;
+}
+
+
 static void module_loadargs(const char *args) {
 
     if (!args || strstr(args, "image:") != args)
@@ -75,6 +141,13 @@ static void module_loadargs(const char *args) {
             if (data.shade > 99)
                 fprintf(stderr, "[shade]: shade not in range [0, 99]\n");
         }
+        else if (strstr(arg, "filter=") == arg) {
+            int filter;
+            if ((filter = get_filter(&arg[7])) == -1)
+                fprintf(stderr, "[image]: unknown filter: %s\n", &arg[7]);
+            else
+                data.filter = filter;
+        }
     }
 
     free(arguments);
@@ -103,6 +176,13 @@ static void module_loadxrdb(XrmDatabase xrdb) {
                 "ALock.Background.Image.Shade", &type, &value))
         data.shade = strtol(value.addr, NULL, 0);
 
+    if (XrmGetResource(xrdb, "alock.background.image.filter",
+                "ALock.Background.Image.Filter", &type, &value)) {
+        int filter;
+        if ((filter = get_filter(value.addr)) != -1)
+            data.filter = filter;
+    }
+
 }
 
 static int module_init(Display *dpy) {
@@ -112,139 +192,54 @@ static int module_init(Display *dpy) {
         return -1;
     }
 
-    if (!alock_check_xrender(dpy))
-        data.shade = 0;
+    /* image itself is loaded upon rendering, however we want to report
+     * an obvious misconfiguration as soon as possible */
+    if (access(data.filename, R_OK) == -1) {
+        perror("[image]: unable to access image file");
+        return -1;
+    }
 
     data.display = dpy;
     data.windows = (Window *)malloc(sizeof(Window) * ScreenCount(dpy));
-    data.pixmaps = (Pixmap *)malloc(sizeof(Pixmap) * ScreenCount(dpy));
+    data.pixmaps = (Pixmap *)calloc(ScreenCount(dpy), sizeof(Pixmap));
+    data.colors = (XColor *)malloc(sizeof(XColor) * ScreenCount(dpy));
+    data.children = (Window **)calloc(ScreenCount(dpy), sizeof(Window *));
+    data.monitors = (struct aMonitor **)malloc(sizeof(struct aMonitor *) * ScreenCount(dpy));
+    data.monitors_count = (int *)malloc(sizeof(int) * ScreenCount(dpy));
+    data.store_keys = (char **)calloc(ScreenCount(dpy), sizeof(char *));
 
     {
         XSetWindowAttributes xswa;
-        XColor color;
-        int i;
+        int i, n;
 
         for (i = 0; i < ScreenCount(dpy); i++) {
 
             Screen *screen = ScreenOfDisplay(dpy, i);
             Colormap colormap = DefaultColormapOfScreen(screen);
-            Window root = RootWindowOfScreen(screen);
-            const int depth = DefaultDepthOfScreen(screen);
-            const int rwidth = WidthOfScreen(screen);
-            const int rheight = HeightOfScreen(screen);
-            alock_alloc_color(dpy, colormap, data.colorname, "black", &color);
-
-            { /* get image and set it as the background pixmap for the window */
-                Imlib_Context context = NULL;
-                Imlib_Image image = NULL;
-
-                context = imlib_context_new();
-                imlib_context_push(context);
-                imlib_context_set_display(dpy);
-                imlib_context_set_visual(DefaultVisualOfScreen(screen));
-                imlib_context_set_colormap(colormap);
-
-                image = imlib_load_image_without_cache(data.filename);
-                if (image) {
-
-                    int w;
-                    int h;
-
-                    data.pixmaps[i] = XCreatePixmap(dpy, root, rwidth, rheight, depth);
-
-                    imlib_context_set_drawable(data.pixmaps[i]);
-                    imlib_context_set_image(image);
-
-                    w = imlib_image_get_width();
-                    h = imlib_image_get_height();
-
-                    if (data.shade || data.option == AIMAGE_OPTION_CENTER) {
-                        GC gc;
-                        XGCValues gcval;
-
-                        gcval.foreground = color.pixel;
-                        gc = XCreateGC(dpy, root, GCForeground, &gcval);
-                        XFillRectangle(dpy, data.pixmaps[i], gc, 0, 0, rwidth, rheight);
-                        XFreeGC(dpy, gc);
-                    }
-
-                    if (data.shade) {
-                        GC gc;
-                        XGCValues gcval;
-
-                        Pixmap tmp_pixmap = XCreatePixmap(dpy, root, w, h, depth);
-                        Pixmap shaded_pixmap = XCreatePixmap(dpy, root, w, h, depth);
-                        gcval.foreground = color.pixel;
-                        gc = XCreateGC(dpy, root, GCForeground, &gcval);
-                        XFillRectangle(dpy, shaded_pixmap, gc, 0, 0, w, h);
-
-                        imlib_context_set_drawable(tmp_pixmap);
-                        imlib_render_image_on_drawable(0, 0);
-
-                        Visual *vis = DefaultVisualOfScreen(screen);
-                        alock_shade_pixmap(dpy, vis, tmp_pixmap, shaded_pixmap, data.shade, 0, 0, 0, 0, w, h);
-
-                        imlib_free_image_and_decache();
-                        imlib_context_set_drawable(shaded_pixmap);
-
-                        image = imlib_create_image_from_drawable(None, 0, 0, w, h, 0);
-
-                        XFreePixmap(dpy, shaded_pixmap);
-                        XFreePixmap(dpy, tmp_pixmap);
-
-                        imlib_context_set_drawable(data.pixmaps[i]);
-                        imlib_context_set_image(image);
-                    }
-
-                    if (data.option == AIMAGE_OPTION_CENTER) {
-                        imlib_render_image_on_drawable((rwidth - w)/2, (rheight - h)/2);
-                    }
-                    else if (data.option == AIMAGE_OPTION_TILED) {
-                        Pixmap tile;
-                        GC gc;
-                        XGCValues gcval;
-
-                        tile = XCreatePixmap(dpy, root, w, h, depth);
-
-                        imlib_render_image_on_drawable(0, 0);
-
-                        gcval.fill_style = FillTiled;
-                        gcval.tile = tile;
-                        gc = XCreateGC(dpy, tile, GCFillStyle|GCTile, &gcval);
-                        XFillRectangle(dpy, data.pixmaps[i], gc, 0, 0, rwidth, rheight);
-
-                        XFreeGC(dpy, gc);
-                        XFreePixmap(dpy, tile);
-                    } else { /* fallback is AIMAGE_OPTION_SCALE */
-                        imlib_render_image_on_drawable_at_size(0, 0, rwidth, rheight);
-                    }
-                    imlib_free_image_and_decache();
-
-                }
-                else {
-                    fprintf(stderr, "[image]: unable to load image from file\n");
-                    free(data.windows);
-                    free(data.pixmaps);
-                    data.windows = NULL;
-                    data.pixmaps = NULL;
-                    return -1;
-                }
-
-                imlib_context_pop();
-                imlib_context_free(context);
-            }
+            alock_alloc_color(dpy, colormap, data.colorname, "black", &data.colors[i]);
 
+            /* window is filled with the color until the image is rendered */
             xswa.override_redirect = True;
             xswa.colormap = colormap;
-            xswa.background_pixmap = data.pixmaps[i];
+            xswa.background_pixel = data.colors[i].pixel;
 
-            data.windows[i] = XCreateWindow(dpy, root,
-                    0, 0, rwidth, rheight, 0,
+            data.windows[i] = XCreateWindow(dpy, RootWindowOfScreen(screen),
+                    0, 0, WidthOfScreen(screen), HeightOfScreen(screen), 0,
                     CopyFromParent, InputOutput, CopyFromParent,
-                    CWOverrideRedirect | CWColormap | CWBackPixmap,
+                    CWOverrideRedirect | CWColormap | CWBackPixel,
                     &xswa);
 
-            XMapWindow(dpy, data.windows[i]);
+            data.monitors_count[i] = alock_get_monitors(dpy, i, &data.monitors[i]);
+
+            /* Children for the centered image are created (unmapped) right
+             * away, so they are stacked below windows reparented into the
+             * background window later on, e.g. the input frame. */
+            if (data.option == AIMAGE_OPTION_CENTER &&
+                    (data.children[i] = (Window *)malloc(sizeof(Window) * data.monitors_count[i])) != NULL)
+                for (n = 0; n < data.monitors_count[i]; n++)
+                    data.children[i][n] = XCreateWindow(dpy, data.windows[i],
+                            0, 0, 1, 1, 0, CopyFromParent, InputOutput, CopyFromParent,
+                            0, NULL);
 
         }
     }
@@ -252,18 +247,596 @@ static int module_init(Display *dpy) {
     return 0;
 }
 
+/* Decode the image file. Decoded image is shared by all screens, so the
+ * file is decoded at most once per rendering. */
+static Imlib_Image load_image(void) {
+
+    unsigned long long t = alock_utime();
+    Imlib_Image image;
+
+    if ((image = imlib_load_image_without_cache(data.filename)) == NULL)
+        fprintf(stderr, "[image]: unable to load image from file\n");
+
+    alock_trace_span("image", "decode", t, "\"result\":%d", image ? 0 : -1);
+    return image;
+}
+
+/* Shade a copy of the given image on the client side by blending it toward
+ * the color. The result is the same as for the server-side shading, but
+ * it does not require any additional transfer through the X connection.
+ * Returned image shall be freed by the caller. */
+static Imlib_Image shade_image(Imlib_Image source, const XColor *color) {
+
+    Imlib_Image image;
+    DATA32 *pixels;
+    size_t n, count;
+
+    imlib_context_set_image(source);
+    if ((image = imlib_clone_image()) == NULL)
+        return NULL;
+
+    imlib_context_set_image(image);
+    pixels = imlib_image_get_data();
+    count = (size_t)imlib_image_get_width() * imlib_image_get_height();
+
+    /* fixed-point blending factor, where 256 stands for 1.0 */
+    const uint32_t a = (data.shade > 100 ? 100 : data.shade) * 256 / 100;
+    const uint32_t r = (color->red >> 8) * (256 - a);
+    const uint32_t g = (color->green >> 8) * (256 - a);
+    const uint32_t b = (color->blue >> 8) * (256 - a);
+
+    for (n = 0; n < count; n++) {
+        const uint32_t p = pixels[n];
+        pixels[n] = (p & 0xff000000) |
+            (((((p >> 16) & 0xff) * a + r) >> 8) << 16) |
+            (((((p >> 8) & 0xff) * a + g) >> 8) << 8) |
+            ((((p & 0xff) * a + b) >> 8));
+    }
+
+    imlib_image_put_back_data(pixels);
+    return image;
+}
+
+/* Get the size of the given pixmap. */
+static void get_pixmap_size(Display *dpy, Pixmap pixmap,
+        unsigned int *width, unsigned int *height) {
+    Window root;
+    unsigned int border;
+    unsigned int depth;
+    int x, y;
+    XGetGeometry(dpy, pixmap, &root, &x, &y, width, height, &border, &depth);
+}
+
+/* Set rendered pixmap as the background of the given screen window. The X
+ * server repeats the tile by itself, while centered image is displayed in
+ * a child window (one per monitor) on top of the solid color background.
+ * In both cases the pixmap holds the image at its native size. */
+static void set_background(Display *dpy, int i) {
+
+    if (data.option == AIMAGE_OPTION_CENTER) {
+
+        const struct aMonitor *monitors = data.monitors[i];
+        unsigned int w, h;
+        int n;
+
+        if (data.children[i] == NULL)
+            return;
+
+        get_pixmap_size(dpy, data.pixmaps[i], &w, &h);
+
+        for (n = 0; n < data.monitors_count[i]; n++) {
+            Window child = data.children[i][n];
+            XMoveResizeWindow(dpy, child,
+                    monitors[n].x + ((int)monitors[n].width - (int)w) / 2,
+                    monitors[n].y + ((int)monitors[n].height - (int)h) / 2,
+                    w, h);
+            XSetWindowBackgroundPixmap(dpy, child, data.pixmaps[i]);
+            XMapWindow(dpy, child);
+            XClearWindow(dpy, child);
+        }
+
+        return;
+    }
+
+    XSetWindowBackgroundPixmap(dpy, data.windows[i], data.pixmaps[i]);
+    XClearWindow(dpy, data.windows[i]);
+}
+
+/* Render decoded source image into the background pixmap of the given
+ * screen. Note, that the source image is not modified. */
+static int render_screen(Display *dpy, int i, Imlib_Image source) {
+
+    Screen *screen = ScreenOfDisplay(dpy, i);
+    Colormap colormap = DefaultColormapOfScreen(screen);
+    Visual *visual = DefaultVisualOfScreen(screen);
+    Window root = RootWindowOfScreen(screen);
+    const int depth = DefaultDepthOfScreen(screen);
+    const int rwidth = WidthOfScreen(screen);
+    const int rheight = HeightOfScreen(screen);
+
+    const struct aMonitor *monitors = data.monitors[i];
+    const int count = data.monitors_count[i];
+    int n;
+
+    Imlib_Context context = NULL;
+    Imlib_Image image = NULL;
+
+    context = imlib_context_new();
+    imlib_context_push(context);
+    imlib_context_set_display(dpy);
+    imlib_context_set_visual(visual);
+    imlib_context_set_colormap(colormap);
+
+    image = source;
+    {
+
+        int shade_server = 0;
+        int native;
+        int w;
+        int h;
+        int pw;
+        int ph;
+
+        imlib_context_set_image(image);
+
+        w = imlib_image_get_width();
+        h = imlib_image_get_height();
+
+        /* Tiled and centered images are displayed at the native size, so
+         * the X server can repeat them for us - see set_background(). */
+        native = data.option == AIMAGE_OPTION_CENTER || data.option == AIMAGE_OPTION_TILED;
+        pw = native ? w : rwidth;
+        ph = native ? h : rheight;
+
+        data.pixmaps[i] = XCreatePixmap(dpy, root, pw, ph, depth);
+        imlib_context_set_drawable(data.pixmaps[i]);
+
+        if (data.shade || native || count > 1) {
+            GC gc;
+            XGCValues gcval;
+
+            gcval.foreground = data.colors[i].pixel;
+            gc = XCreateGC(dpy, root, GCForeground, &gcval);
+            XFillRectangle(dpy, data.pixmaps[i], gc, 0, 0, pw, ph);
+            XFreeGC(dpy, gc);
+        }
+
+        if (data.shade) {
+
+            /* Both methods upload the image only once, so select the one,
+             * which processes fewer pixels. However, for remote connections
+             * prefer the X server, which renders with the help of the local
+             * graphics hardware. */
+            if (alock_check_xrender(dpy))
+                shade_server = !alock_local_connection(dpy) ||
+                    (unsigned long long)w * h > (unsigned long long)pw * ph;
+
+            if (!shade_server) {
+                unsigned long long t = alock_utime();
+                image = shade_image(source, &data.colors[i]);
+                alock_trace_span("image", "shade-client", t, "\"screen\":%d", i);
+                if (image == NULL)
+                    goto final;
+            }
+
+        }
+
+        if (native) {
+            imlib_render_image_on_drawable(0, 0);
+        }
+        else if (data.filter != AIMAGE_FILTER_NONE && alock_check_xrender(dpy)) {
+            /* upload the image at its native size and let the X server
+             * scale it into the background pixmap */
+            unsigned long long t = alock_utime();
+            Pixmap pixmap = XCreatePixmap(dpy, root, w, h, depth);
+            GC gc;
+            XGCValues gcval;
+
+            /* image might be blended with the drawable content */
+            gcval.foreground = data.colors[i].pixel;
+            gc = XCreateGC(dpy, root, GCForeground, &gcval);
+            XFillRectangle(dpy, pixmap, gc, 0, 0, w, h);
+            XFreeGC(dpy, gc);
+
+            imlib_context_set_drawable(pixmap);
+            imlib_render_image_on_drawable(0, 0);
+
+            for (n = 0; n < count; n++)
+                alock_scale_pixmap(dpy, visual, pixmap, w, h, data.pixmaps[i],
+                        monitors[n].x, monitors[n].y, monitors[n].width, monitors[n].height,
+                        filter_names[data.filter]);
+
+            XFreePixmap(dpy, pixmap);
+            XSync(dpy, False);
+            alock_trace_span("image", "scale-server", t, "\"screen\":%d,\"filter\":\"%s\"",
+                    i, filter_names[data.filter]);
+        }
+        else { /* fallback is AIMAGE_OPTION_SCALE */
+            for (n = 0; n < count; n++)
+                imlib_render_image_on_drawable_at_size(monitors[n].x, monitors[n].y,
+                        monitors[n].width, monitors[n].height);
+        }
+        if (image != source)
+            imlib_free_image();
+
+        if (shade_server) {
+            unsigned long long t = alock_utime();
+            alock_tint_pixmap(dpy, visual, data.pixmaps[i], &data.colors[i],
+                    data.shade, 0, 0, pw, ph);
+            XSync(dpy, False);
+            alock_trace_span("image", "shade-server", t, "\"screen\":%d", i);
+        }
+
+    }
+
+final:
+    imlib_context_pop();
+    imlib_context_free(context);
+
+    if (!image) {
+        fprintf(stderr, "[image]: unable to render image\n");
+        return -1;
+    }
+
+    set_background(dpy, i);
+    return 0;
+}
+
+/* Get the cache key for the background of the given screen. The key covers
+ * everything what affects the rendered image: the image file, rendering
+ * options and screen geometry. Returned string shall be freed with the
+ * free() function. */
+static char *cache_key(Display *dpy, int i) {
+
+    Screen *screen = ScreenOfDisplay(dpy, i);
+    Visual *visual = DefaultVisualOfScreen(screen);
+    const struct aMonitor *monitors = data.monitors[i];
+    struct stat st;
+    char *path;
+    char *key;
+    size_t size;
+    FILE *f;
+    int n;
+
+    if ((path = realpath(data.filename, NULL)) == NULL)
+        return NULL;
+    if (stat(path, &st) == -1 || (f = open_memstream(&key, &size)) == NULL) {
+        free(path);
+        return NULL;
+    }
+
+    fprintf(f, "file=%s\nmtime=%lld.%09ld\nsize=%lld\n", path,
+            (long long)st.st_mtim.tv_sec, st.st_mtim.tv_nsec, (long long)st.st_size);
+    fprintf(f, "option=%d\nfilter=%d\nshade=%u\ncolor=%lu\n", data.option, data.filter,
+            data.shade, data.colors[i].pixel);
+    fprintf(f, "screen=%dx%dx%d\nvisual=%lx:%lx:%lx\nmonitors=",
+            WidthOfScreen(screen), HeightOfScreen(screen), DefaultDepthOfScreen(screen),
+            visual->red_mask, visual->green_mask, visual->blue_mask);
+
+    for (n = 0; n < data.monitors_count[i]; n++)
+        fprintf(f, "%d,%d,%ux%u;", monitors[n].x, monitors[n].y,
+                monitors[n].width, monitors[n].height);
+
+    fclose(f);
+    free(path);
+    return key;
+}
+
+/* Get the cache file path for the given screen. There is only one entry per
+ * screen (the key is stored within the file and verified upon loading), so
+ * a new entry replaces the outdated one and the cache does not grow upon
+ * every wallpaper or layout change. This function creates the cache
+ * directory, if it does not exist. Returned string shall be freed with the
+ * free() function. */
+static char *cache_path(Display *dpy, int i) {
+
+    const char *home = getenv("HOME");
+    const char *base = getenv("XDG_CACHE_HOME");
+    const char *name = DisplayString(dpy);
+    char dir[1024];
+    char *path;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    if (base == NULL || base[0] == '\0') {
+        if (home == NULL)
+            return NULL;
+        snprintf(dir, sizeof(dir), "%s/.cache", home);
+        mkdir(dir, 0700);
+        strncat(dir, "/alock", sizeof(dir) - strlen(dir) - 1);
+    }
+    else
+        snprintf(dir, sizeof(dir), "%s/alock", base);
+
+    if (mkdir(dir, 0700) == -1 && access(dir, W_OK) == -1)
+        return NULL;
+
+    /* 64-bit FNV-1a hash of the display name */
+    for (; *name; name++)
+        hash = (hash ^ (unsigned char)*name) * 0x100000001b3ULL;
+
+    if ((path = malloc(strlen(dir) + 48)) != NULL)
+        sprintf(path, "%s/%016llx-%d.bg", dir, (unsigned long long)hash, i);
+    return path;
+}
+
+/* Load cached background of the given screen into the pixmap. This function
+ * returns 0 on success, otherwise -1. */
+static int cache_load(Display *dpy, int i, const char *key) {
+
+    Screen *screen = ScreenOfDisplay(dpy, i);
+    Visual *visual = DefaultVisualOfScreen(screen);
+    const struct cacheHeader *header;
+    unsigned long long t = alock_utime();
+    struct stat st;
+    XImage *image;
+    char *path;
+    void *map;
+    int fd;
+    int rv = -1;
+
+    if ((path = cache_path(dpy, i)) == NULL)
+        return -1;
+    fd = open(path, O_RDONLY);
+    free(path);
+    if (fd == -1)
+        return -1;
+
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(*header) ||
+            (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+
+    header = (const struct cacheHeader *)map;
+    if (memcmp(header->magic, CACHE_MAGIC, sizeof(header->magic)) != 0 ||
+            header->key_length != strlen(key) ||
+            sizeof(*header) + header->key_length > (size_t)st.st_size ||
+            memcmp((const char *)map + sizeof(*header), key, header->key_length) != 0 ||
+            (long long)header->data_offset + (long long)header->bytes_per_line * header->height > st.st_size ||
+            header->width == 0 || header->height == 0)
+        goto final;
+
+    const char *pixels = (const char *)map + header->data_offset;
+    GC gc = DefaultGCOfScreen(screen);
+
+    data.pixmaps[i] = XCreatePixmap(dpy, RootWindowOfScreen(screen),
+            header->width, header->height, header->depth);
+
+    /* upload via the shared memory, if possible */
+    if (alock_check_xshm(dpy) &&
+            (image = alock_create_image(dpy, visual, header->depth,
+                    header->width, header->height)) != NULL) {
+        if ((unsigned)image->bytes_per_line == header->bytes_per_line &&
+                (unsigned)image->bits_per_pixel == header->bits_per_pixel &&
+                (unsigned)image->byte_order == header->byte_order) {
+            memcpy(image->data, pixels, (size_t)header->bytes_per_line * header->height);
+            alock_put_image(dpy, data.pixmaps[i], gc, image, 0, 0, 0, 0,
+                    header->width, header->height);
+            rv = 0;
+        }
+        alock_destroy_image(dpy, image);
+    }
+
+    if (rv == -1 && (image = XCreateImage(dpy, visual, header->depth, ZPixmap, 0,
+                    (char *)pixels, header->width, header->height, 32,
+                    header->bytes_per_line)) != NULL) {
+        if ((unsigned)image->bits_per_pixel == header->bits_per_pixel &&
+                (unsigned)image->byte_order == header->byte_order) {
+            XPutImage(dpy, data.pixmaps[i], gc, image, 0, 0, 0, 0,
+                    header->width, header->height);
+            rv = 0;
+        }
+        /* image data is owned by the mapping */
+        image->data = NULL;
+        XDestroyImage(image);
+    }
+
+    if (rv == -1) {
+        XFreePixmap(dpy, data.pixmaps[i]);
+        data.pixmaps[i] = None;
+    }
+
+final:
+    munmap(map, st.st_size);
+    close(fd);
+    alock_trace_span("image", "cache-load", t, "\"screen\":%d,\"result\":%d", i, rv);
+    return rv;
+}
+
+/* Store rendered background of the given screen in the cache. The file is
+ * written under a temporary name and renamed afterwards, so concurrent
+ * readers will never see a partially written file. */
+static void cache_store(Display *dpy, int i, const char *key) {
+
+    Screen *screen = ScreenOfDisplay(dpy, i);
+    unsigned long long t = alock_utime();
+    struct cacheHeader header;
+    unsigned int width, height;
+    XImage *image;
+    char *path;
+    char *tmp;
+    FILE *f;
+    int fd;
+    int ok;
+
+    if ((path = cache_path(dpy, i)) == NULL)
+        return;
+    if ((tmp = malloc(strlen(path) + 8)) == NULL) {
+        free(path);
+        return;
+    }
+
+    sprintf(tmp, "%s.XXXXXX", path);
+    if ((fd = mkstemp(tmp)) == -1 || (f = fdopen(fd, "w")) == NULL) {
+        if (fd != -1) {
+            close(fd);
+            unlink(tmp);
+        }
+        goto final;
+    }
+
+    get_pixmap_size(dpy, data.pixmaps[i], &width, &height);
+    image = alock_get_image(dpy, data.pixmaps[i], DefaultVisualOfScreen(screen),
+            DefaultDepthOfScreen(screen), 0, 0, width, height);
+
+    if ((ok = image != NULL)) {
+
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+        header.key_length = strlen(key);
+        header.width = image->width;
+        header.height = image->height;
+        header.depth = image->depth;
+        header.bits_per_pixel = image->bits_per_pixel;
+        header.bytes_per_line = image->bytes_per_line;
+        header.byte_order = image->byte_order;
+        /* align image data to the page size, so it can be mapped directly */
+        header.data_offset = (sizeof(header) + header.key_length + 4095) & ~4095;
+
+        ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+            fwrite(key, header.key_length, 1, f) == 1 &&
+            fseek(f, header.data_offset, SEEK_SET) == 0 &&
+            fwrite(image->data, (size_t)image->bytes_per_line * image->height, 1, f) == 1;
+
+        alock_destroy_image(dpy, image);
+    }
+
+    if (fclose(f) != 0 || !ok || rename(tmp, path) == -1) {
+        debug("Unable to store background cache: %s", path);
+        unlink(tmp);
+    }
+
+    alock_trace_span("image", "cache-store", t, "\"screen\":%d", i);
+
+final:
+    free(path);
+    free(tmp);
+}
+
+/* Store all pending cache entries. This function is executed in a worker
+ * thread, so the readback of rendered pixmaps and the disk write do not
+ * delay the input processing. */
+static void *cache_store_thread(void *arg) {
+    int i;
+    (void)arg;
+    for (i = 0; i < ScreenCount(data.display); i++)
+        if (data.store_keys[i] != NULL) {
+            cache_store(data.display, i, data.store_keys[i]);
+            free(data.store_keys[i]);
+            data.store_keys[i] = NULL;
+        }
+    return NULL;
+}
+
+/* Wait for the cache storing worker, if it is running. */
+static void cache_store_wait(void) {
+    if (data.store_running) {
+        pthread_join(data.store_thread, NULL);
+        data.store_running = 0;
+    }
+}
+
+/* Render background of the given screen, using the cache if possible. The
+ * source image is decoded upon the first cache miss. Rendered background is
+ * only marked for storing - see cache_store_thread(). */
+static int render_screen_cached(Display *dpy, int i, Imlib_Image *source) {
+
+    char *key = cache_key(dpy, i);
+    int rv = 0;
+
+    if (key != NULL && cache_load(dpy, i, key) == 0)
+        set_background(dpy, i);
+    else if (*source == NULL && (*source = load_image()) == NULL)
+        rv = -1;
+    else if ((rv = render_screen(dpy, i, *source)) == 0 && key != NULL &&
+            /* for remote connections the readback would be a full
+             * framebuffer transfer, which is what the cache avoids */
+            alock_local_connection(dpy)) {
+        data.store_keys[i] = key;
+        key = NULL;
+    }
+
+    free(key);
+    return rv;
+}
+
+static int module_render(unsigned long deadline) {
+
+    Display *dpy = data.display;
+    Imlib_Image source = NULL;
+    int rv = 0;
+    int i;
+
+    if (!data.windows)
+        return -1;
+
+    /* previous rendering might still be storing its result */
+    cache_store_wait();
+
+    /* Rendered pixmaps are kept for the whole module lifetime, so in the
+     * daemon mode the image is processed only once. */
+    for (i = 0; i < ScreenCount(dpy); i++) {
+        if (data.pixmaps[i] != None)
+            continue;
+        if (alock_deadline_passed(dpy, deadline)) {
+            fprintf(stderr, "[image]: rendering deadline exceeded\n");
+            rv = -1;
+            break;
+        }
+        if ((rv = render_screen_cached(dpy, i, &source)) == -1)
+            break;
+    }
+
+    if (source != NULL) {
+        imlib_context_set_image(source);
+        imlib_free_image_and_decache();
+    }
+
+    for (i = 0; i < ScreenCount(dpy); i++)
+        if (data.store_keys[i] != NULL)
+            break;
+    /* store new cache entries in the background */
+    if (i < ScreenCount(dpy)) {
+        if (pthread_create(&data.store_thread, NULL, cache_store_thread, NULL) == 0)
+            data.store_running = 1;
+        else
+            for (; i < ScreenCount(dpy); i++) {
+                free(data.store_keys[i]);
+                data.store_keys[i] = NULL;
+            }
+    }
+
+    return rv;
+}
+
 static void module_free() {
 
     if (data.windows) {
         int i;
+        cache_store_wait();
         for (i = 0; i < ScreenCount(data.display); i++) {
+            free(data.store_keys[i]);
+            /* child windows are destroyed together with the parent */
             XDestroyWindow(data.display, data.windows[i]);
-            XFreePixmap(data.display, data.pixmaps[i]);
+            if (data.pixmaps[i] != None)
+                XFreePixmap(data.display, data.pixmaps[i]);
+            free(data.children[i]);
+            free(data.monitors[i]);
         }
         free(data.windows);
         free(data.pixmaps);
+        free(data.children);
+        free(data.monitors);
+        free(data.monitors_count);
+        free(data.store_keys);
+        free(data.colors);
         data.windows = NULL;
         data.pixmaps = NULL;
+        data.children = NULL;
+        data.monitors = NULL;
+        data.monitors_count = NULL;
+        data.store_keys = NULL;
+        data.colors = NULL;
     }
 
     free(data.colorname);
@@ -288,4 +861,6 @@ struct aModuleBackground alock_bg_image = {
         module_free,
     },
     module_getwindow,
+    module_dummy_capture,
+    module_render,
 };
@@ -29,4 +29,6 @@ struct aModuleBackground alock_bg_none = {
         module_dummy_free,
     },
     module_getwindow,
+    module_dummy_capture,
+    module_dummy_render,
 };
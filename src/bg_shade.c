@@ -8,18 +8,23 @@
  * This project is licensed under the terms of the MIT license.
  *
  * This background module provides:
- *  -bg shade:color=<color>,shade=<int>,blur=<int>,mono
+ *  -bg shade:color=<color>,shade=<int>,blur=<int>,blurmode=<mode>,blurlevels=<int>,
+ *      tile=<int>,mono
  *
  * Used resources:
  *  ALock.Background.Shade.Color
  *  ALock.Background.Shade.Shade
  *  ALock.Background.Shade.Blur
+ *  ALock.Background.Shade.BlurMode
+ *  ALock.Background.Shade.BlurLevels
+ *  ALock.Background.Shade.Tile
  *  ALock.Background.Shade.Mono
  *
  */
 
 #include "alock.h"
 
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include <X11/extensions/Xrender.h>
@@ -28,13 +33,56 @@
 static struct moduleData {
     Display *display;
     Window *windows;
+    unsigned long *pixels;
+    struct aMonitor **monitors;
+    int *monitors_count;
+    Pixmap *snapshots;
+    XImage **images;
     char *colorname;
     unsigned int shade;
     unsigned int blur;
+    enum aBlurMode blurmode;
+    unsigned int blurlevels;
+    unsigned int tile;
     char monochrome;
-} data = { NULL, NULL, NULL, 80, 0, 0 };
+    char readback;
+} data = { NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, 80, 0, ABLUR_MODE_DEFAULT, 0, 0, 0, 0 };
+
+/* Region of the screen processed as a single tile. */
+struct tileRegion {
+    /* position and size of the tile */
+    int x, y;
+    unsigned int width;
+    unsigned int height;
+    /* position and size of the tile extended by the blur halo */
+    int hx, hy;
+    unsigned int hwidth;
+    unsigned int hheight;
+    /* monitor which contains the tile */
+    const struct aMonitor *monitor;
+};
+
+/* Tile image (including halo) fetched from the band pixmap. */
+struct tileFetch {
+    Pixmap pixmap;
+    Visual *visual;
+    int depth;
+    int x, y;
+    unsigned int width;
+    unsigned int height;
+    XImage *image;
+    int ready;
+};
 
 
+static void set_blurmode(const char *name) {
+    int mode;
+    if ((mode = alock_blur_mode(name)) == -1)
+        fprintf(stderr, "[shade]: unknown blur mode: %s\n", name);
+    else
+        data.blurmode = mode;
+}
+
 static void module_loadargs(const char *args) {
 
     if (!args || strstr(args, "shade:") != args)
@@ -56,6 +104,15 @@ static void module_loadargs(const char *args) {
         else if (strstr(arg, "blur=") == arg) {
             data.blur = strtol(&arg[5], NULL, 0);
         }
+        else if (strstr(arg, "blurmode=") == arg) {
+            set_blurmode(&arg[9]);
+        }
+        else if (strstr(arg, "blurlevels=") == arg) {
+            data.blurlevels = strtol(&arg[11], NULL, 0);
+        }
+        else if (strstr(arg, "tile=") == arg) {
+            data.tile = strtol(&arg[5], NULL, 0);
+        }
         else if (strcmp(arg, "mono") == 0) {
             data.monochrome = 1;
         }
@@ -81,6 +138,18 @@ static void module_loadxrdb(XrmDatabase xrdb) {
                 "ALock.Background.Shade.Blur", &type, &value))
         data.blur = strtol(value.addr, NULL, 0);
 
+    if (XrmGetResource(xrdb, "alock.background.shade.blurmode",
+                "ALock.Background.Shade.BlurMode", &type, &value))
+        set_blurmode(value.addr);
+
+    if (XrmGetResource(xrdb, "alock.background.shade.blurlevels",
+                "ALock.Background.Shade.BlurLevels", &type, &value))
+        data.blurlevels = strtol(value.addr, NULL, 0);
+
+    if (XrmGetResource(xrdb, "alock.background.shade.tile",
+                "ALock.Background.Shade.Tile", &type, &value))
+        data.tile = strtol(value.addr, NULL, 0);
+
     if (XrmGetResource(xrdb, "alock.background.shade.mono",
                 "ALock.Background.Shade.Mono", &type, &value))
         data.monochrome = strcmp(value.addr, "true") == 0;
@@ -89,67 +158,471 @@ static void module_loadxrdb(XrmDatabase xrdb) {
 
 static int module_init(Display *dpy) {
 
-    if (!alock_check_xrender(dpy))
+    if (!alock_check_xrender(dpy)) {
+        fprintf(stderr, "[shade]: missing X Render Extension support\n");
         return -1;
+    }
 
     /* show warning message when value is out of reasonable range */
     if (data.shade > 100)
         fprintf(stderr, "[shade]: shade not in range [0, 100]\n");
     if (data.blur > 100)
         fprintf(stderr, "[shade]: blur not in range [0, 100]\n");
+    if (data.tile && data.tile < 64) {
+        fprintf(stderr, "[shade]: tile size too small, using 64\n");
+        data.tile = 64;
+    }
+
+    /* The whole processing can be done by the X server, unless monochrome
+     * conversion is requested and the server does not support the HSL blend
+     * modes. In such a case, use shared memory for transferring snapshots,
+     * if possible. */
+    data.readback = data.monochrome && !alock_check_xrender_version(dpy, 0, 11);
 
     data.display = dpy;
     data.windows = (Window *)malloc(sizeof(Window) * ScreenCount(dpy));
+    data.pixels = (unsigned long *)malloc(sizeof(unsigned long) * ScreenCount(dpy));
+    data.monitors = (struct aMonitor **)malloc(sizeof(struct aMonitor *) * ScreenCount(dpy));
+    data.monitors_count = (int *)malloc(sizeof(int) * ScreenCount(dpy));
+    data.snapshots = (Pixmap *)calloc(ScreenCount(dpy), sizeof(Pixmap));
+    data.images = (XImage **)calloc(ScreenCount(dpy), sizeof(XImage *));
 
     int i;
 
     for (i = 0; i < ScreenCount(dpy); i++) {
 
         Screen *screen = ScreenOfDisplay(dpy, i);
-        Window root = RootWindowOfScreen(screen);
         Colormap colormap = DefaultColormapOfScreen(screen);
-        GC gc = DefaultGCOfScreen(screen);
-        int width = WidthOfScreen(screen);
-        int height = HeightOfScreen(screen);
-        int depth = DefaultDepthOfScreen(screen);
-
-        /* grab whats on the screen */
-        XImage *image = XGetImage(dpy, root, 0, 0, width, height, AllPlanes, ZPixmap);
-        if (data.monochrome)  /* optional monochrome conversion */
-            alock_grayscale_image(image, 0, 0, width, height);
-        Pixmap src_pm = XCreatePixmap(dpy, root, width, height, depth);
-        XPutImage(dpy, src_pm, gc, image, 0, 0, 0, 0, width, height);
-        XDestroyImage(image);
 
         XColor color;
         alock_alloc_color(dpy, colormap, data.colorname, "black", &color);
-        XGCValues tintval = { .foreground = color.pixel };
-
-        Pixmap dst_pm = XCreatePixmap(dpy, root, width, height, depth);
-        GC tintgc = XCreateGC(dpy, dst_pm, GCForeground, &tintval);
-        XFillRectangle(dpy, dst_pm, tintgc, 0, 0, width, height);
-        XFreeGC(dpy, tintgc);
+        data.pixels[i] = color.pixel;
 
-        Visual *vis = DefaultVisualOfScreen(screen);
-        alock_shade_pixmap(dpy, vis, src_pm, dst_pm, data.shade, 0, 0, 0, 0, width, height);
-        XCopyArea(dpy, dst_pm, src_pm, gc, 0, 0, width, height, 0, 0);
-        alock_blur_pixmap(dpy, vis, src_pm, dst_pm, data.blur, 0, 0, 0, 0, width, height);
+        /* only visible parts of the screen are processed */
+        data.monitors_count[i] = alock_get_monitors(dpy, i, &data.monitors[i]);
 
-        /* create final window */
+        /* create final window, it is filled with the fallback color until
+         * the captured screen content is rendered */
         XSetWindowAttributes xswa = {
-            .background_pixmap = dst_pm,
+            .background_pixel = color.pixel,
             .override_redirect = True,
             .colormap = colormap,
         };
-        data.windows[i] = XCreateWindow(dpy, root,
-                0, 0, width, height, 0,
+        data.windows[i] = XCreateWindow(dpy, RootWindowOfScreen(screen),
+                0, 0, WidthOfScreen(screen), HeightOfScreen(screen), 0,
                 CopyFromParent, InputOutput, CopyFromParent,
-                CWOverrideRedirect | CWColormap | CWBackPixmap,
+                CWOverrideRedirect | CWColormap | CWBackPixel,
                 &xswa);
 
+    }
+
+    return 0;
+}
+
+/* Take the snapshot of the given screen. */
+static int capture_screen(unsigned int i, void *arg) {
+    (void)arg;
+
+    Display *dpy = data.display;
+    Screen *screen = ScreenOfDisplay(dpy, i);
+    Window root = RootWindowOfScreen(screen);
+    int width = WidthOfScreen(screen);
+    int height = HeightOfScreen(screen);
+    unsigned long long t = alock_utime();
+
+    /* drop snapshot which was not rendered (e.g. failed lock) */
+    if (data.snapshots[i])
+        XFreePixmap(dpy, data.snapshots[i]);
+    if (data.images[i])
+        alock_destroy_image(dpy, data.images[i]);
+    data.snapshots[i] = None;
+    data.images[i] = NULL;
+
+    /* in the tiled mode, tiles are fetched from the snapshot pixmap */
+    if (data.readback && !data.tile) {
+        /* grab whats on the screen */
+        data.images[i] = alock_get_image(dpy, root,
+                DefaultVisualOfScreen(screen), DefaultDepthOfScreen(screen),
+                0, 0, width, height);
+        alock_trace_span("shade", "capture", t, "\"screen\":%u,\"readback\":1", i);
+        return data.images[i] ? 0 : -1;
+    }
+
+    /* Copy content (including all windows) of every monitor on the server
+     * side - area outside of monitors is not visible anyway. However, the
+     * blur reads pixels around monitors, so fill such area with the tint
+     * color instead of leaving the pixmap content uninitialized. */
+    XGCValues gcval = { .subwindow_mode = IncludeInferiors, .foreground = data.pixels[i] };
+    Pixmap pixmap = XCreatePixmap(dpy, root, width, height, DefaultDepthOfScreen(screen));
+    GC gc = XCreateGC(dpy, pixmap, GCSubwindowMode | GCForeground, &gcval);
+    const struct aMonitor *m;
+    XFillRectangle(dpy, pixmap, gc, 0, 0, width, height);
+    for (m = data.monitors[i]; m < &data.monitors[i][data.monitors_count[i]]; m++)
+        XCopyArea(dpy, root, pixmap, gc, m->x, m->y, m->width, m->height, m->x, m->y);
+    XFreeGC(dpy, gc);
+    data.snapshots[i] = pixmap;
+
+    alock_trace_span("shade", "capture", t, "\"screen\":%u,\"readback\":0", i);
+    return 0;
+}
+
+/* Get the number of tiles required to cover the given monitor. */
+static unsigned int tile_count(const struct aMonitor *m) {
+    return ((m->width + data.tile - 1) / data.tile) *
+        ((m->height + data.tile - 1) / data.tile);
+}
+
+/* Get the region of the tile with the given index. Tiles of the first
+ * monitor are followed by tiles of the next one and so on. The tile halo
+ * is clipped to the monitor boundaries. */
+static void tile_region(struct tileRegion *r, unsigned int index,
+        const struct aMonitor *m, unsigned int margin) {
+
+    const unsigned int size = data.tile;
+    unsigned int columns;
+    unsigned int tiles;
+
+    for (; (tiles = tile_count(m)) <= index; m++)
+        index -= tiles;
+
+    columns = (m->width + size - 1) / size;
+    r->x = index % columns * size;
+    r->y = index / columns * size;
+    r->width = m->width - r->x < size ? m->width - r->x : size;
+    r->height = m->height - r->y < size ? m->height - r->y : size;
+
+    r->hx = r->x > (int)margin ? r->x - (int)margin : 0;
+    r->hy = r->y > (int)margin ? r->y - (int)margin : 0;
+    r->hwidth = (r->x + r->width + margin < m->width ?
+            r->x + r->width + margin : m->width) - r->hx;
+    r->hheight = (r->y + r->height + margin < m->height ?
+            r->y + r->height + margin : m->height) - r->hy;
+
+    /* translate to the screen coordinates */
+    r->monitor = m;
+    r->x += m->x;
+    r->y += m->y;
+    r->hx += m->x;
+    r->hy += m->y;
+
+}
+
+/* Fetch the tile image (including halo) for the client-side processing. */
+static void *tile_fetch(void *arg) {
+    struct tileFetch *f = (struct tileFetch *)arg;
+    f->image = alock_get_image(data.display, f->pixmap, f->visual, f->depth,
+            f->x, f->y, f->width, f->height);
+    f->ready = 1;
+    return NULL;
+}
+
+/* Set up fetching of the given tile from the band pixmap. */
+static void tile_fetch_setup(struct tileFetch *f, Pixmap band, const struct tileRegion *r) {
+    f->pixmap = band;
+    f->x = r->hx - r->monitor->x;
+    f->y = 0;
+    f->width = r->hwidth;
+    f->height = r->hheight;
+    f->ready = 0;
+}
+
+/* Shade and blur the snapshot of the given screen tile by tile. The result
+ * is written back into the snapshot, so it is the only full-screen pixmap.
+ * Since the blur reads the original pixels around every tile, the current
+ * row of tiles (extended by the halo) is copied into the band pixmap before
+ * it is processed. The halo above the row has already been overwritten in
+ * the snapshot, so it is taken from the band of the previous row. Hence,
+ * besides the snapshot, only two bands (monitor wide) and a few tile-sized
+ * pixmaps are used, and the memory usage is bounded by the tile size.
+ *
+ * Tiles at the monitor edges have their halo clipped, so they are processed
+ * in pixmaps of the exact size - otherwise the blur would read leftovers of
+ * the previous tile. When the client-side conversion is required, fetching
+ * of the next tile in the row overlaps with the processing of the current
+ * one. */
+static int render_screen_tiled(unsigned int i, Pixmap snapshot, unsigned long deadline) {
+
+    Display *dpy = data.display;
+    Screen *screen = ScreenOfDisplay(dpy, i);
+    Window root = RootWindowOfScreen(screen);
+    Visual *vis = DefaultVisualOfScreen(screen);
+    GC gc = DefaultGCOfScreen(screen);
+    int depth = DefaultDepthOfScreen(screen);
+    const unsigned int margin = alock_blur_margin(data.blurmode, data.blur, data.blurlevels);
+    const unsigned int size = data.tile + 2 * margin;
+    const struct aMonitor *monitors = data.monitors[i];
+    unsigned int band_width = 0;
+    unsigned int count = 0;
+    struct tileFetch fetch[2] = {
+        { None, vis, depth, 0, 0, 0, 0, NULL, 0 },
+        { None, vis, depth, 0, 0, 0, 0, NULL, 0 },
+    };
+    struct tileRegion row = { 0 };
+    pthread_t fetch_thread;
+    Pixmap bands[2];
+    unsigned int band = 0;
+    unsigned int n;
+    int rv = 0;
+
+    for (n = 0; n < (unsigned)data.monitors_count[i]; n++) {
+        count += tile_count(&monitors[n]);
+        if (monitors[n].width > band_width)
+            band_width = monitors[n].width;
+    }
+
+    debug("Shade tiles: %u, size: %ux%u", count, size, size);
+
+    Pixmap src_pm = XCreatePixmap(dpy, root, size, size, depth);
+    Pixmap shade_pm = XCreatePixmap(dpy, root, size, size, depth);
+    Pixmap blur_pm = XCreatePixmap(dpy, root, size, size, depth);
+    bands[0] = XCreatePixmap(dpy, root, band_width, size, depth);
+    bands[1] = XCreatePixmap(dpy, root, band_width, size, depth);
+
+    XGCValues tintval = { .foreground = data.pixels[i] };
+    GC tintgc = XCreateGC(dpy, snapshot, GCForeground, &tintval);
+
+    for (n = 0; n < count; n++) {
+
+        struct tileFetch *f = &fetch[n % 2];
+        struct tileRegion r;
+        Pixmap tile_src_pm = src_pm;
+        Pixmap tile_shade_pm = shade_pm;
+        Pixmap tile_blur_pm = blur_pm;
+        const struct aMonitor *m;
+        int fetching = 0;
+        int edge;
+
+        if (alock_deadline_passed(dpy, deadline)) {
+            rv = -1;
+            break;
+        }
+
+        tile_region(&r, n, monitors, margin);
+        m = r.monitor;
+
+        if (n == 0 || r.monitor != row.monitor || r.y != row.y) {
+            /* Copy original pixels of the new row of tiles into the band.
+             * Rows of the halo above this row are taken from the previous
+             * band, the remaining ones are still intact in the snapshot. */
+            int top = 0;
+            if (n > 0 && r.monitor == row.monitor) {
+                top = r.y - r.hy;
+                XCopyArea(dpy, bands[band], bands[!band], gc,
+                        0, r.hy - row.hy, m->width, top, 0, 0);
+                band = !band;
+            }
+            XCopyArea(dpy, snapshot, bands[band], gc,
+                    m->x, r.hy + top, m->width, r.hheight - top, 0, top);
+            row = r;
+        }
+
+        if ((edge = r.hwidth != size || r.hheight != size)) {
+            tile_src_pm = XCreatePixmap(dpy, root, r.hwidth, r.hheight, depth);
+            tile_shade_pm = XCreatePixmap(dpy, root, r.hwidth, r.hheight, depth);
+            tile_blur_pm = XCreatePixmap(dpy, root, r.hwidth, r.hheight, depth);
+        }
+
+        if (data.readback) {
+
+            /* the first tile of the row can not be prefetched */
+            if (!f->ready) {
+                tile_fetch_setup(f, bands[band], &r);
+                tile_fetch(f);
+            }
+
+            /* start fetching the next tile of the row in the background */
+            if (n + 1 < count) {
+                struct tileFetch *next = &fetch[(n + 1) % 2];
+                struct tileRegion nr;
+                tile_region(&nr, n + 1, monitors, margin);
+                if (nr.monitor == r.monitor && nr.y == r.y) {
+                    tile_fetch_setup(next, bands[band], &nr);
+                    if (!(fetching = pthread_create(&fetch_thread, NULL, tile_fetch, next) == 0))
+                        tile_fetch(next);
+                }
+            }
+
+            if (f->image) {
+                alock_grayscale_image(f->image, 0, 0, r.hwidth, r.hheight);
+                alock_put_image(dpy, tile_src_pm, gc, f->image, 0, 0, 0, 0, r.hwidth, r.hheight);
+                alock_destroy_image(dpy, f->image);
+                f->image = NULL;
+            }
+            f->ready = 0;
+
+        }
+        else {
+            XCopyArea(dpy, bands[band], tile_src_pm, gc, r.hx - m->x, 0,
+                    r.hwidth, r.hheight, 0, 0);
+            if (data.monochrome)
+                alock_grayscale_pixmap(dpy, vis, tile_src_pm, 0, 0, r.hwidth, r.hheight);
+        }
+
+        XFillRectangle(dpy, tile_shade_pm, tintgc, 0, 0, r.hwidth, r.hheight);
+        alock_shade_pixmap(dpy, vis, tile_src_pm, tile_shade_pm, data.shade,
+                0, 0, 0, 0, r.hwidth, r.hheight);
+
+        if (data.blur) {
+            alock_blur_pixmap(dpy, vis, tile_shade_pm, tile_blur_pm, data.blurmode, data.blur,
+                    data.blurlevels, 0, 0, 0, 0, r.hwidth, r.hheight);
+            XCopyArea(dpy, tile_blur_pm, snapshot, gc, r.x - r.hx, r.y - r.hy,
+                    r.width, r.height, r.x, r.y);
+        }
+        else
+            XCopyArea(dpy, tile_shade_pm, snapshot, gc, r.x - r.hx, r.y - r.hy,
+                    r.width, r.height, r.x, r.y);
+
+        if (edge) {
+            XFreePixmap(dpy, tile_src_pm);
+            XFreePixmap(dpy, tile_shade_pm);
+            XFreePixmap(dpy, tile_blur_pm);
+        }
+
+        if (fetching)
+            pthread_join(fetch_thread, NULL);
+
+    }
+
+    /* drop prefetched tile, if processing was interrupted */
+    for (n = 0; n < 2; n++)
+        if (fetch[n].image)
+            alock_destroy_image(dpy, fetch[n].image);
+
+    /* area outside of monitors has been filled with the tint color upon
+     * the capture, so the snapshot is the final background */
+    if (rv == 0 && alock_deadline_passed(dpy, deadline))
+        rv = -1;
+    if (rv == 0) {
+        XSetWindowBackgroundPixmap(dpy, data.windows[i], snapshot);
+        XClearWindow(dpy, data.windows[i]);
+    }
+
+    XFreeGC(dpy, tintgc);
+    XFreePixmap(dpy, src_pm);
+    XFreePixmap(dpy, shade_pm);
+    XFreePixmap(dpy, blur_pm);
+    XFreePixmap(dpy, bands[0]);
+    XFreePixmap(dpy, bands[1]);
+
+    return rv;
+}
+
+/* Shade and blur the snapshot of the given screen. */
+static int render_screen(unsigned int i, void *arg) {
+
+    const unsigned long deadline = *(unsigned long *)arg;
+    Display *dpy = data.display;
+    Screen *screen = ScreenOfDisplay(dpy, i);
+    Window root = RootWindowOfScreen(screen);
+    Visual *vis = DefaultVisualOfScreen(screen);
+    GC gc = DefaultGCOfScreen(screen);
+    int width = WidthOfScreen(screen);
+    int height = HeightOfScreen(screen);
+    int depth = DefaultDepthOfScreen(screen);
+    unsigned long long t = alock_utime();
+    const struct aMonitor *monitors = data.monitors[i];
+    const struct aMonitor *m;
+    XImage *image = data.images[i];
+    Pixmap src_pm = data.snapshots[i];
+    int rv = 0;
+
+    if (image == NULL && src_pm == None)
+        return 0;
+    data.images[i] = NULL;
+    data.snapshots[i] = None;
+
+    if (alock_deadline_passed(dpy, deadline)) {
+        if (image)
+            alock_destroy_image(dpy, image);
+        if (src_pm)
+            XFreePixmap(dpy, src_pm);
+        return -1;
+    }
+
+    if (data.tile) {
+        rv = render_screen_tiled(i, src_pm, deadline);
         XFreePixmap(dpy, src_pm);
-        XFreePixmap(dpy, dst_pm);
+        alock_trace_span("shade", "render", t, "\"screen\":%u,\"tiled\":1,\"result\":%d", i, rv);
+        return rv;
+    }
+
+    if (image) {
+        XGCValues fillval = { .foreground = data.pixels[i] };
+        src_pm = XCreatePixmap(dpy, root, width, height, depth);
+        GC fillgc = XCreateGC(dpy, src_pm, GCForeground, &fillval);
+        /* area outside of monitors is read by the blur - see capture */
+        XFillRectangle(dpy, src_pm, fillgc, 0, 0, width, height);
+        XFreeGC(dpy, fillgc);
+        for (m = monitors; m < &monitors[data.monitors_count[i]]; m++) {
+            /* optional client-side monochrome conversion */
+            if (data.monochrome)
+                alock_grayscale_image(image, m->x, m->y, m->width, m->height);
+            alock_put_image(dpy, src_pm, gc, image, m->x, m->y, m->x, m->y, m->width, m->height);
+        }
+        alock_destroy_image(dpy, image);
+    }
+    else if (data.monochrome)
+        for (m = monitors; m < &monitors[data.monitors_count[i]]; m++)
+            alock_grayscale_pixmap(dpy, vis, src_pm, m->x, m->y, m->width, m->height);
+
+    XGCValues tintval = { .foreground = data.pixels[i] };
+
+    Pixmap dst_pm = XCreatePixmap(dpy, root, width, height, depth);
+    GC tintgc = XCreateGC(dpy, dst_pm, GCForeground, &tintval);
+    XFillRectangle(dpy, dst_pm, tintgc, 0, 0, width, height);
+    XFreeGC(dpy, tintgc);
+
+    for (m = monitors; m < &monitors[data.monitors_count[i]]; m++) {
+        alock_shade_pixmap(dpy, vis, src_pm, dst_pm, data.shade,
+                m->x, m->y, m->x, m->y, m->width, m->height);
+        XCopyArea(dpy, dst_pm, src_pm, gc, m->x, m->y, m->width, m->height, m->x, m->y);
+    }
+
+    /* When the deadline has passed (either before or during the blur), the
+     * window is left with the fallback color. Otherwise, swap in the rendered
+     * background. Note, that the window keeps its own reference to the
+     * background pixmap. */
+    if (alock_deadline_passed(dpy, deadline))
+        rv = -1;
+    else {
+        for (m = monitors; m < &monitors[data.monitors_count[i]]; m++)
+            alock_blur_pixmap(dpy, vis, src_pm, dst_pm, data.blurmode, data.blur, data.blurlevels,
+                    m->x, m->y, m->x, m->y, m->width, m->height);
+        if (alock_deadline_passed(dpy, deadline))
+            rv = -1;
+    }
+    if (rv == 0) {
+        XSetWindowBackgroundPixmap(dpy, data.windows[i], dst_pm);
+        XClearWindow(dpy, data.windows[i]);
+    }
+
+    XFreePixmap(dpy, src_pm);
+    XFreePixmap(dpy, dst_pm);
+
+    alock_trace_span("shade", "render", t, "\"screen\":%u,\"result\":%d", i, rv);
+    return rv;
+}
 
+static int module_capture(void) {
+
+    if (!data.windows)
+        return -1;
+
+    return alock_parallel(ScreenCount(data.display), capture_screen, NULL);
+}
+
+static int module_render(unsigned long deadline) {
+
+    if (!data.windows)
+        return -1;
+
+    /* every screen is processed by its own worker thread */
+    if (alock_parallel(ScreenCount(data.display), render_screen, &deadline) == -1) {
+        if (deadline && alock_mtime() > deadline)
+            fprintf(stderr, "[shade]: rendering deadline exceeded\n");
+        else
+            fprintf(stderr, "[shade]: rendering failed\n");
+        return -1;
     }
 
     return 0;
@@ -159,10 +632,26 @@ static void module_free() {
 
     if (data.windows) {
         int i;
-        for (i = 0; i < ScreenCount(data.display); i++)
+        for (i = 0; i < ScreenCount(data.display); i++) {
             XDestroyWindow(data.display, data.windows[i]);
+            if (data.snapshots[i])
+                XFreePixmap(data.display, data.snapshots[i]);
+            if (data.images[i])
+                alock_destroy_image(data.display, data.images[i]);
+            free(data.monitors[i]);
+        }
         free(data.windows);
+        free(data.pixels);
+        free(data.monitors);
+        free(data.monitors_count);
+        free(data.snapshots);
+        free(data.images);
         data.windows = NULL;
+        data.pixels = NULL;
+        data.monitors = NULL;
+        data.monitors_count = NULL;
+        data.snapshots = NULL;
+        data.images = NULL;
     }
 
     free(data.colorname);
@@ -185,4 +674,6 @@ struct aModuleBackground alock_bg_shade = {
         module_free,
     },
     module_getwindow,
+    module_capture,
+    module_render,
 };
@@ -7,13 +7,16 @@
  * This project is licensed under the terms of the MIT license.
  *
  * This input module provides:
- *  -input frame:input=<color>,check=<color>,error=<color>,width=<int>
+ *  -input frame:input=<color>,check=<color>,error=<color>,width=<int>,
+ *              penalty=<int>,backoff
  *
  * Used resources:
  *  ALock.Input.Frame.Color.Input
  *  ALock.Input.Frame.Color.Check
  *  ALock.Input.Frame.Color.Error
  *  ALock.Input.Frame.Width
+ *  ALock.Input.Frame.Penalty
+ *  ALock.Input.Frame.Backoff
  *
  */
 
@@ -21,7 +24,6 @@
 
 #include <stdlib.h>
 #include <string.h>
-#include <unistd.h>
 #include <X11/Xlib.h>
 #include <X11/keysym.h>
 #if HAVE_XEXT
@@ -29,6 +31,9 @@
 #endif
 
 
+/* upper limit of the input penalty, also with the exponential backoff (ms) */
+#define PENALTY_MAX 60000
+
 struct colorPixel {
     char *name;
     unsigned long pixel;
@@ -37,12 +42,30 @@ struct colorPixel {
 static struct moduleData {
     Display *display;
     Window window;
+#if !HAVE_XEXT
+    GC gc;
+#endif
+    enum aInputState state;
     struct colorPixel color_input;
     struct colorPixel color_check;
     struct colorPixel color_error;
+    XRectangle *frames;
+    int frames_count;
     int width;
-} data = { NULL, None, { 0 }, { 0 }, { 0 }, 10 };
+    unsigned int penalty;
+    char backoff;
+} data = { .width = 10, .penalty = 1000 };
+
 
+/* Set the base input penalty, which is clamped to the upper limit. */
+static void set_penalty(const char *value) {
+    unsigned long penalty = strtoul(value, NULL, 0);
+    if (penalty > PENALTY_MAX) {
+        fprintf(stderr, "[frame]: penalty value out of range, using %d\n", PENALTY_MAX);
+        penalty = PENALTY_MAX;
+    }
+    data.penalty = penalty;
+}
 
 static void module_loadargs(const char *args) {
 
@@ -70,6 +93,12 @@ static void module_loadargs(const char *args) {
             free(data.color_error.name);
             data.color_error.name = strdup(&arg[6]);
         }
+        else if (strstr(arg, "penalty=") == arg) {
+            set_penalty(&arg[8]);
+        }
+        else if (strcmp(arg, "backoff") == 0) {
+            data.backoff = 1;
+        }
     }
 
     free(arguments);
@@ -84,6 +113,13 @@ static void module_loadxrdb(XrmDatabase xrdb) {
                 "ALock.Input.Frame.Width", &type, &value))
         data.width = strtol(value.addr, NULL, 0);
 
+    if (XrmGetResource(xrdb, "alock.input.frame.penalty",
+                "ALock.Input.Frame.Penalty", &type, &value))
+        set_penalty(value.addr);
+    if (XrmGetResource(xrdb, "alock.input.frame.backoff",
+                "ALock.Input.Frame.Backoff", &type, &value))
+        data.backoff = strcmp(value.addr, "true") == 0;
+
     if (XrmGetResource(xrdb, "alock.input.frame.color.input",
                 "ALock.Input.Frame.Color.Input", &type, &value))
         data.color_input.name = strdup(value.addr);
@@ -104,6 +140,7 @@ static int module_init(Display *dpy) {
     XColor color;
 
     data.display = dpy;
+    data.state = AINPUT_STATE_NONE;
 
     xswa.override_redirect = True;
     xswa.colormap = colormap;
@@ -120,14 +157,32 @@ static int module_init(Display *dpy) {
     alock_alloc_color(dpy, colormap, data.color_error.name, "red", &color);
     data.color_error.pixel = color.pixel;
 
+    /* every monitor gets its own frame made of four rectangles */
+    struct aMonitor *monitors;
+    int count = alock_get_monitors(dpy, DefaultScreen(dpy), &monitors);
+    int i;
+
+    data.frames = (XRectangle *)malloc(sizeof(XRectangle) * 4 * count);
+    data.frames_count = 4 * count;
+
+    for (i = 0; i < count; i++) {
+        const struct aMonitor *m = &monitors[i];
+        XRectangle *r = &data.frames[4 * i];
+        r[0] = (XRectangle){ m->x, m->y, m->width, data.width };
+        r[1] = (XRectangle){ m->x, m->y, data.width, m->height };
+        r[2] = (XRectangle){ m->x, m->y + m->height - data.width, m->width, data.width };
+        r[3] = (XRectangle){ m->x + m->width - data.width, m->y, data.width, m->height };
+    }
+
+    free(monitors);
+
 #if HAVE_XEXT
-    XRectangle rect = {
-        0, 0,
-        WidthOfScreen(screen) - 2 * data.width,
-        HeightOfScreen(screen) - 2 * data.width,
-    };
+    /* The window is shaped to the frame, so the frame is painted with the
+     * window background by the X server itself - also upon exposure. */
     XShapeCombineRectangles(dpy, data.window, ShapeBounding,
-            data.width, data.width, &rect, 1, ShapeSubtract, 0);
+            0, 0, data.frames, data.frames_count, ShapeSet, Unsorted);
+#else
+    data.gc = XCreateGC(dpy, data.window, 0, NULL);
 #endif
 
     return 0;
@@ -135,8 +190,15 @@ static int module_init(Display *dpy) {
 
 static void module_free(void) {
 
+#if !HAVE_XEXT
+    XFreeGC(data.display, data.gc);
+#endif
     XDestroyWindow(data.display, data.window);
 
+    free(data.frames);
+    data.frames = NULL;
+    data.frames_count = 0;
+
     free(data.color_input.name);
     data.color_input.name = NULL;
     free(data.color_check.name);
@@ -170,50 +232,65 @@ static void module_setstate(enum aInputState state) {
     debug("setstate: %d", state);
 
     Display *dpy = data.display;
-    XGCValues gcvals;
-    int height, width;
+    const enum aInputState previous = data.state;
+    unsigned long pixel;
+
+    /* there is nothing to redraw */
+    if (state == data.state)
+        return;
+    data.state = state;
 
     if (state == AINPUT_STATE_NONE) {
         /* hide input frame indicator */
         XUnmapWindow(dpy, data.window);
         return;
     }
-    if (state == AINPUT_STATE_INIT) {
-        /* show input frame indicator */
-        XMapWindow(dpy, data.window);
-        XRaiseWindow(dpy, data.window);
-    }
 
     switch (state) {
     case AINPUT_STATE_CHECK:
-        gcvals.foreground = data.color_check.pixel;
+        pixel = data.color_check.pixel;
         break;
     case AINPUT_STATE_ERROR:
-        gcvals.foreground = data.color_error.pixel;
+        pixel = data.color_error.pixel;
         break;
     default:
-        gcvals.foreground = data.color_input.pixel;
+        pixel = data.color_input.pixel;
     }
 
-    Screen *screen = DefaultScreenOfDisplay(dpy);
-    width = WidthOfScreen(screen);
-    height = HeightOfScreen(screen);
-
-    GC gc = XCreateGC(dpy, data.window, 0, 0);
-    XChangeGC(dpy, gc, GCForeground, &gcvals);
-    XFillRectangle(dpy, data.window, gc, 0, 0, width, data.width);
-    XFillRectangle(dpy, data.window, gc, 0, 0, data.width, height);
-    XFillRectangle(dpy, data.window, gc, 0, height - data.width, width, data.width);
-    XFillRectangle(dpy, data.window, gc, width - data.width, 0, data.width, height);
-    XFreeGC(dpy, gc);
-    XFlush(dpy);
+#if HAVE_XEXT
+    XSetWindowBackground(dpy, data.window, pixel);
+    XClearWindow(dpy, data.window);
+#endif
 
-    /* internal input penalty for error */
-    if (state == AINPUT_STATE_ERROR) {
-        sleep(1);
-        /* discard all pending events in the queue */
-        XSync(dpy, True);
+    /* Show input frame indicator upon any transition out of the none state.
+     * Coalesced input events might skip the init state altogether, e.g. when
+     * the password is pasted or typed during the background rendering. */
+    if (previous == AINPUT_STATE_NONE) {
+        XMapWindow(dpy, data.window);
+        XRaiseWindow(dpy, data.window);
     }
+
+#if !HAVE_XEXT
+    XSetForeground(dpy, data.gc, pixel);
+    XFillRectangles(dpy, data.window, data.gc, data.frames, data.frames_count);
+#endif
+
+    XFlush(dpy);
+}
+
+static unsigned int module_penalty(unsigned int failures) {
+
+    unsigned int penalty = data.penalty;
+
+    /* double the penalty upon every consecutive failure */
+    if (data.backoff)
+        while (failures-- > 1 && penalty < PENALTY_MAX)
+            penalty *= 2;
+
+    if (penalty > PENALTY_MAX)
+        penalty = PENALTY_MAX;
+
+    return penalty;
 }
 
 
@@ -227,4 +304,5 @@ struct aModuleInput alock_input_frame = {
     module_getwindow,
     module_keypress,
     module_setstate,
+    module_penalty,
 };
@@ -29,6 +29,11 @@ static KeySym module_keypress(KeySym key) {
     return key;
 }
 
+static unsigned int module_penalty(unsigned int failures) {
+    (void)failures;
+    return 0;
+}
+
 
 struct aModuleInput alock_input_none = {
     {  "none",
@@ -40,4 +45,5 @@ struct aModuleInput alock_input_none = {
     module_getwindow,
     module_keypress,
     module_setstate,
+    module_penalty,
 };
@@ -12,8 +12,12 @@
 #include "alock.h"
 
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <locale.h>
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
 #include <spawn.h>
 #include <stdlib.h>
@@ -27,10 +31,75 @@
 #include <X11/Xproto.h>
 #include <X11/Xutil.h>
 #include <X11/keysym.h>
+#if ENABLE_XRANDR
+# include <X11/extensions/Xrandr.h>
+#endif
+
 
+/* maximal interval between input devices grab attempts (ms) */
+#define GRAB_RETRY_INTERVAL 5
+/* inactivity time after which the entered phrase is discarded (ms) */
+#define INPUT_TIMEOUT 5000
+/* maximal length of the entered phrase (in characters) */
+#define PHRASE_MAX_LENGTH 128
 
 extern char **environ;
 
+/* module arguments given in the command line */
+struct aModulesArgs {
+    const char *auth;
+    const char *background;
+    const char *cursor;
+    const char *input;
+};
+
+/* groups of modules which can be initialized independently */
+enum aModulesGroup {
+    AMODULES_GROUP_AUTH,
+    AMODULES_GROUP_DISPLAY,
+};
+
+/* data passed to the modules initialization function */
+struct aModulesInit {
+    Display *display;
+    struct aModules *modules;
+    const struct aModulesArgs *args;
+};
+
+/* authentication performed in the background by the worker thread */
+struct authWorker {
+    struct aModuleAuth *auth;
+    pthread_t thread;
+    /* worker writes a single byte upon completion */
+    int pipe[2];
+    char phrase[PHRASE_MAX_LENGTH * sizeof(wchar_t)];
+    int result;
+    int running;
+    int cancelled;
+};
+
+/* self-pipe used for lock requests delivered via signal */
+static int signal_pipe[2] = { -1, -1 };
+/* there is at most one authentication in flight */
+static struct authWorker auth_worker = { .pipe = { -1, -1 } };
+/* requested and applied state of the input module */
+static struct {
+    enum aInputState requested;
+    enum aInputState current;
+} input_state = { AINPUT_STATE_NONE, AINPUT_STATE_NONE };
+/* modules have to be reinitialized before the next lock */
+static int modules_outdated = 0;
+/* background rendering deadline in milliseconds (zero for none) */
+static unsigned int render_deadline = 0;
+/* time budget for grabbing input devices in milliseconds */
+static unsigned int grab_timeout = 1000;
+#if ENABLE_XRANDR
+/* base of the X RandR extension events, -1 if not selected */
+static int xrandr_event_base = -1;
+#endif
+/* start time-stamp of the process, until the first lock (zero for none) */
+static unsigned long long startup_time = 0;
+
 static struct aModuleAuth *alock_modules_auth[] = {
 #if ENABLE_PAM
     &alock_auth_pam,
@@ -131,6 +200,160 @@ static void unregisterInstance(Display *display) {
 
 }
 
+/* Synchronize with the X server when tracing is enabled. Otherwise, traced
+ * time would not include the processing time of asynchronous requests. */
+static void traceSync(Display *display) {
+    if (alock_trace_enabled())
+        XSync(display, False);
+}
+
+/* Load module X resources and record the trace event for this call. */
+static void moduleLoadxrdb(const char *type, struct aModule *m, XrmDatabase xrdb) {
+    unsigned long long t = alock_utime();
+    m->loadxrdb(xrdb);
+    alock_trace_span(type, "loadxrdb", t, "\"module\":\"%s\"", m->name);
+}
+
+/* Load module arguments and record the trace event for this call. */
+static void moduleLoadargs(const char *type, struct aModule *m, const char *args) {
+    unsigned long long t = alock_utime();
+    m->loadargs(args);
+    alock_trace_span(type, "loadargs", t, "\"module\":\"%s\"", m->name);
+}
+
+/* Initialize module and record the trace event for this call. */
+static int moduleInit(const char *type, struct aModule *m, Display *display) {
+    unsigned long long t = alock_utime();
+    int rv = m->init(display);
+    traceSync(display);
+    alock_trace_span(type, "init", t, "\"module\":\"%s\",\"result\":%d", m->name, rv);
+    return rv;
+}
+
+/* Initialize the given group of modules. Groups do not depend on each other,
+ * so they can be initialized in parallel. This function returns 0 on success,
+ * otherwise -1. */
+static int initModules(unsigned int group, void *arg) {
+
+    const struct aModulesInit *init = (struct aModulesInit *)arg;
+    struct aModules *modules = init->modules;
+    const struct aModulesArgs *args = init->args;
+    int rv = 0;
+
+    if (group == AMODULES_GROUP_AUTH) {
+        if (moduleInit("auth", &modules->auth->m, init->display)) {
+            fprintf(stderr, "alock: failed init of [%s] with [%s]\n",
+                    modules->auth->m.name, args->auth);
+            rv = -1;
+        }
+        return rv;
+    }
+
+    if (moduleInit("background", &modules->background->m, init->display)) {
+        fprintf(stderr, "alock: failed init of [%s] with [%s]\n",
+                modules->background->m.name, args->background);
+        rv = -1;
+    }
+    if (moduleInit("cursor", &modules->cursor->m, init->display)) {
+        fprintf(stderr, "alock: failed init of [%s] with [%s]\n",
+                modules->cursor->m.name, args->cursor);
+        rv = -1;
+    }
+    if (moduleInit("input", &modules->input->m, init->display)) {
+        fprintf(stderr, "alock: failed init of [%s] with [%s]\n",
+                modules->input->m.name, args->input);
+        rv = -1;
+    }
+
+    return rv;
+}
+
+/* Get X resource database based on the RESOURCE_MANAGER property. Note, that
+ * the XResourceManagerString() returns the value obtained upon connection,
+ * so it can not be used for detecting changes in long-running process. */
+static XrmDatabase getResourceDatabase(Display *display) {
+
+    XrmDatabase xrdb;
+    Atom ret_type;
+    int ret_fmt;
+    unsigned long ret_nb;
+    unsigned long ret_bleft;
+    char *ret_data = NULL;
+    unsigned long long t = alock_utime();
+
+    XrmInitialize();
+    XGetWindowProperty(display, RootWindow(display, 0), XA_RESOURCE_MANAGER,
+            0L, 100000000L, False, XA_STRING, &ret_type, &ret_fmt,
+            &ret_nb, &ret_bleft, (unsigned char **)&ret_data);
+    xrdb = XrmGetStringDatabase(ret_data != NULL ? ret_data : "");
+    XFree(ret_data);
+
+    alock_trace_span("main", "XrmGetStringDatabase", t, NULL);
+    return xrdb;
+}
+
+/* Reinitialize background, cursor and input modules with the current X
+ * resources. Authentication module is left intact, because we might not
+ * have required privileges any more. On success this function returns 0,
+ * otherwise -1. */
+static int reloadModules(Display *display, struct aModules *modules,
+        const struct aModulesArgs *args) {
+
+    struct aModulesInit init = { display, modules, args };
+    XrmDatabase xrdb;
+
+    /* input window might be a child of the background one, so it has to be
+     * destroyed in the first place */
+    modules->input->m.free();
+    modules->cursor->m.free();
+    modules->background->m.free();
+
+    xrdb = getResourceDatabase(display);
+
+    moduleLoadxrdb("background", &modules->background->m, xrdb);
+    moduleLoadxrdb("cursor", &modules->cursor->m, xrdb);
+    moduleLoadxrdb("input", &modules->input->m, xrdb);
+
+    XrmDestroyDatabase(xrdb);
+
+    moduleLoadargs("background", &modules->background->m, args->background);
+    moduleLoadargs("cursor", &modules->cursor->m, args->cursor);
+    moduleLoadargs("input", &modules->input->m, args->input);
+
+    return initModules(AMODULES_GROUP_DISPLAY, &init);
+}
+
+/* Update the geometry of the screen upon root window configure event. Xlib
+ * does not track such changes by itself, so without this update our windows
+ * would have an outdated size after the next initialization. */
+static void updateScreenGeometry(Display *display, const XConfigureEvent *ev) {
+
+    Screen *screen;
+    int i;
+
+    for (i = 0; i < ScreenCount(display); i++) {
+        if (ev->window != RootWindow(display, i))
+            continue;
+        screen = ScreenOfDisplay(display, i);
+        if (screen->width != ev->width || screen->height != ev->height) {
+            debug("screen %d geometry changed: %dx%d", i, ev->width, ev->height);
+            screen->width = ev->width;
+            screen->height = ev->height;
+            modules_outdated = 1;
+        }
+    }
+
+}
+
+/* Signal handler used in the daemon mode for requesting the lock (SIGUSR1)
+ * and for the termination (SIGTERM). */
+static void signalHandler(int sig) {
+    int errno_save = errno;
+    if (write(signal_pipe[1], sig == SIGTERM ? "T" : "L", 1) == -1)
+        debug("signal pipe write failed");
+    errno = errno_save;
+}
+
 #if WITH_XBLIGHT
 /* Get the current backlight brightness value. If such a parameter can not be
  * obtained - display output is not compatible, xbacklight is not available,
@@ -174,13 +397,82 @@ static void setBacklightBrightness(float value) {
 }
 #endif /* WITH_XBLIGHT */
 
+/* Predicate for events selected only for the time of grabbing input devices,
+ * i.e. focus changes and notifications about root window children. */
+static Bool isGrabWakeupEvent(Display *display, XEvent *ev, XPointer arg) {
+    (void)display;
+    (void)arg;
+    switch (ev->type) {
+    case FocusIn:
+    case FocusOut:
+    case CreateNotify:
+        return True;
+    case DestroyNotify:
+    case UnmapNotify:
+    case MapNotify:
+    case ReparentNotify:
+    case ConfigureNotify:
+    case GravityNotify:
+    case CirculateNotify:
+        /* structure notification for the root window itself */
+        return ev->xconfigure.event != ev->xconfigure.window;
+    }
+    return False;
+}
+
+/* Grab the pointer (or the keyboard) until success or until the deadline is
+ * reached. Between attempts we wait for any event from the X server, but no
+ * longer than a few milliseconds. This function returns the number of taken
+ * attempts, which is negative if the grab has failed. */
+static int grabDevice(Display *display, Window window, Cursor cursor,
+        int keyboard, unsigned long deadline) {
+
+    struct pollfd pfd = { ConnectionNumber(display), POLLIN, 0 };
+    unsigned long now;
+    int attempts = 0;
+    int timeout;
+    int status;
+    XEvent ev;
+
+    for (;;) {
+
+        attempts++;
+        if (keyboard)
+            status = XGrabKeyboard(display, window, True,
+                    GrabModeAsync, GrabModeAsync, CurrentTime);
+        else
+            status = XGrabPointer(display, window, False, None,
+                    GrabModeAsync, GrabModeAsync, None, cursor, CurrentTime);
+
+        if (status == GrabSuccess)
+            return attempts;
+
+        if ((now = alock_mtime()) >= deadline)
+            return -attempts;
+
+        debug("grab %s failed: %d", keyboard ? "keyboard" : "pointer", status);
+
+        /* consume wake-up events, so they will not wake us up again */
+        while (XCheckIfEvent(display, &ev, isGrabWakeupEvent, NULL))
+            continue;
+
+        timeout = deadline - now;
+        if (timeout > GRAB_RETRY_INTERVAL)
+            timeout = GRAB_RETRY_INTERVAL;
+        poll(&pfd, 1, timeout);
+
+    }
+
+}
+
 /* Lock current display and grab pointer and keyboard. On successful
  * lock this function returns 0, otherwise -1. */
 static int lockDisplay(Display *display, struct aModules *modules) {
 
     Window window;
     Cursor cursor;
-    int i;
+    unsigned long long t;
+    int i, rv;
 
     for (i = 0; i < ScreenCount(display); i++) {
 
@@ -192,68 +484,272 @@ static int lockDisplay(Display *display, struct aModules *modules) {
             if ((window_input = modules->input->getwindow(i)) != None)
                 XReparentWindow(display, window_input, window, 0, 0);
 
+            t = alock_utime();
             XMapWindow(display, window);
+            traceSync(display);
+            alock_trace_span("lock", "map", t, "\"screen\":%d", i);
+
+            t = alock_utime();
             XRaiseWindow(display, window);
+            traceSync(display);
+            alock_trace_span("lock", "raise", t, "\"screen\":%d", i);
 
         }
 
-        /* receive notification about root window geometry change */
-        XSelectInput(display, RootWindow(display, i), StructureNotifyMask);
     }
 
     /* grab pointer and keyboard from the default screen */
     window = DefaultRootWindow(display);
     cursor = modules->cursor->getcursor();
 
-    if (XGrabPointer(display, window, False, None, GrabModeAsync, GrabModeAsync, None,
-                cursor, CurrentTime) != GrabSuccess) {
-        fprintf(stderr, "error: grab pointer failed\n");
-        return -1;
-    }
+    {
+        XWindowAttributes attr;
+        unsigned long deadline = alock_mtime() + grab_timeout;
+        XEvent ev;
+
+        /* Another process (window manager, opened menu) may have grabbed
+         * input devices already. Such a grab is usually released when the
+         * focus is changed or some window is unmapped, so we want to be
+         * notified about such events while waiting. */
+        XGetWindowAttributes(display, window, &attr);
+        XSelectInput(display, window,
+                attr.your_event_mask | SubstructureNotifyMask | FocusChangeMask);
+
+        t = alock_utime();
+        rv = grabDevice(display, window, cursor, 0, deadline);
+        alock_trace_span("lock", "XGrabPointer", t, "\"attempts\":%d", abs(rv));
+        if (rv < 0)
+            fprintf(stderr, "error: grab pointer failed (%d attempts, %llu ms)\n",
+                    -rv, (alock_utime() - t) / 1000);
+
+        if (rv > 0) {
+            t = alock_utime();
+            rv = grabDevice(display, window, None, 1, deadline);
+            alock_trace_span("lock", "XGrabKeyboard", t, "\"attempts\":%d", abs(rv));
+            if (rv < 0)
+                fprintf(stderr, "error: grab keyboard failed (%d attempts, %llu ms)\n",
+                        -rv, (alock_utime() - t) / 1000);
+        }
+
+        XSelectInput(display, window, attr.your_event_mask);
+        XSync(display, False);
+        while (XCheckIfEvent(display, &ev, isGrabWakeupEvent, NULL))
+            continue;
 
-    /* try to grab 2 times, another process (windowmanager) may have grabbed
-     * the keyboard already */
-    if (XGrabKeyboard(display, window, True, GrabModeAsync, GrabModeAsync,
-                CurrentTime) != GrabSuccess) {
-        sleep(1);
-        if (XGrabKeyboard(display, window, True, GrabModeAsync, GrabModeAsync,
-                    CurrentTime) != GrabSuccess) {
-            fprintf(stderr, "error: grab keyboard failed\n");
+        if (rv < 0)
             return -1;
-        }
     }
 
     return 0;
 }
 
+/* Release grabbed pointer and keyboard and hide all our windows. */
+static void unlockDisplay(Display *display, struct aModules *modules) {
+
+    Window window;
+    int i;
+
+    XUngrabKeyboard(display, CurrentTime);
+    XUngrabPointer(display, CurrentTime);
+
+    modules->input->setstate(AINPUT_STATE_NONE);
+    for (i = 0; i < ScreenCount(display); i++)
+        if ((window = modules->background->getwindow(i)) != None)
+            XUnmapWindow(display, window);
+
+    XSync(display, False);
+}
+
+/* Authenticate the phrase and notify the event loop via the worker pipe. */
+static void *authWorkerThread(void *arg) {
+
+    struct authWorker *worker = (struct authWorker *)arg;
+    unsigned long long t = alock_utime();
+
+    worker->result = worker->auth->authenticate(worker->phrase);
+    alock_trace_span("auth", "authenticate", t, "\"module\":\"%s\",\"result\":%d",
+            worker->auth->m.name, worker->result);
+    memset(worker->phrase, 0, sizeof(worker->phrase));
+
+    if (write(worker->pipe[1], "A", 1) == -1)
+        debug("auth pipe write failed");
+
+    return NULL;
+}
+
+/* Start the authentication of the given phrase in the background. Upon
+ * completion the worker pipe becomes readable and the result shall be
+ * collected with the authFinish() function. This function returns 0 on
+ * success, otherwise -1. */
+static int authStart(struct aModuleAuth *auth, const wchar_t *pass) {
+
+    struct authWorker *worker = &auth_worker;
+    int i;
+
+    if (worker->pipe[0] == -1) {
+        /* if possible do not page the phrase to the swap area */
+        mlock(worker->phrase, sizeof(worker->phrase));
+        if (pipe(worker->pipe) == -1)
+            worker->pipe[0] = worker->pipe[1] = -1;
+        else
+            for (i = 0; i < 2; i++) {
+                fcntl(worker->pipe[i], F_SETFL, O_NONBLOCK);
+                fcntl(worker->pipe[i], F_SETFD, FD_CLOEXEC);
+            }
+    }
+
+    if (worker->pipe[0] == -1)
+        return -1;
+
+    wcstombs(worker->phrase, pass, sizeof(worker->phrase));
+    worker->auth = auth;
+    worker->cancelled = 0;
+
+    if (pthread_create(&worker->thread, NULL, authWorkerThread, worker) != 0) {
+        memset(worker->phrase, 0, sizeof(worker->phrase));
+        return -1;
+    }
+
+    worker->running = 1;
+    return 0;
+}
+
+/* Collect the result of the background authentication. This function
+ * returns 0 on success, otherwise (also if the authentication has been
+ * cancelled) -1. */
+static int authFinish(void) {
+
+    struct authWorker *worker = &auth_worker;
+    char buffer[16];
+
+    while (read(worker->pipe[0], buffer, sizeof(buffer)) > 0)
+        continue;
+    pthread_join(worker->thread, NULL);
+    worker->running = 0;
+
+    if (worker->cancelled) {
+        debug("cancelled authentication result: %d", worker->result);
+        return -1;
+    }
+
+    return worker->result == 0 ? 0 : -1;
+}
+
+/* Request the state of the input module. Requested state is applied with
+ * the updateInputState() function, so all state changes made while
+ * processing a batch of events result in a single redraw. */
+static void setInputState(enum aInputState state) {
+    input_state.requested = state;
+}
+
+/* Apply the last requested state of the input module. */
+static void updateInputState(struct aModules *modules) {
+    if (input_state.requested != input_state.current) {
+        input_state.current = input_state.requested;
+        modules->input->setstate(input_state.current);
+    }
+}
+
+/* Indicate failed authentication and start the input penalty, if requested
+ * by the input module. This function returns the time-stamp until which the
+ * input shall be ignored, or zero if there is no penalty. */
+static unsigned long inputPenalty(struct aModules *modules, unsigned int failures) {
+
+    unsigned int penalty;
+
+    setInputState(AINPUT_STATE_ERROR);
+    if ((penalty = modules->input->penalty(failures)) == 0) {
+        setInputState(AINPUT_STATE_INIT);
+        return 0;
+    }
+
+    debug("input penalty: %u ms", penalty);
+    return alock_mtime() + penalty;
+}
+
 static void eventLoop(Display *display, struct aModules *modules) {
 
+    struct pollfd pfds[2] = {
+        { ConnectionNumber(display), POLLIN, 0 },
+        { -1, POLLIN, 0 },
+    };
+    unsigned long elapsed = 0;
+    unsigned long penalty_time = 0;
+    unsigned int failures = 0;
+    unsigned long now;
+    int timeout;
     XEvent ev;
     KeySym ks;
     char cbuf[10];
-    wchar_t pass[128];
+    wchar_t pass[PHRASE_MAX_LENGTH] = { 0 };
     unsigned int clen;
     unsigned int pass_pos = 0, pass_len = 0;
     unsigned long keypress_time = 0;
+    unsigned int events;
 
     /* if possible do not page this address to the swap area */
     mlock(pass, sizeof(pass));
 
+    /* input module is hidden when the display is being locked */
+    input_state.requested = input_state.current = AINPUT_STATE_NONE;
+
     debug("entering event main loop");
     for (;;) {
 
-        if (keypress_time) {
+        if (keypress_time || auth_worker.running) {
             /* check for any key press event (or root window state change) */
             if (XCheckMaskEvent(display, KeyPressMask | StructureNotifyMask, &ev) == False) {
 
+                now = alock_mtime();
+
+                /* input penalty has elapsed, so accept input again */
+                if (penalty_time && now >= penalty_time) {
+                    setInputState(AINPUT_STATE_INIT);
+                    keypress_time = now;
+                    penalty_time = 0;
+                }
+
                 /* user fell asleep while typing (5 seconds inactivity) */
-                if (alock_mtime() - keypress_time > 5000) {
-                    modules->input->setstate(AINPUT_STATE_NONE);
+                if (!auth_worker.running && !penalty_time &&
+                        (elapsed = now - keypress_time) >= INPUT_TIMEOUT) {
+                    setInputState(AINPUT_STATE_NONE);
                     keypress_time = 0;
+                    continue;
+                }
+
+                if (penalty_time)
+                    timeout = penalty_time - now;
+                else if (auth_worker.running)
+                    timeout = -1;
+                else
+                    timeout = INPUT_TIMEOUT - elapsed;
+
+                /* All pending data has been read from the connection by the
+                 * check above, so wait until the X server sends us anything
+                 * new or the authentication completes, but no longer than
+                 * until the penalty or inactivity timeout. */
+                pfds[1].fd = auth_worker.running ? auth_worker.pipe[0] : -1;
+                updateInputState(modules);
+                XFlush(display);
+                if (poll(pfds, 2, timeout) == -1 && errno != EINTR)
+                    perror("alock: poll failed");
+
+                if (auth_worker.running && pfds[1].revents & POLLIN) {
+
+                    int cancelled = auth_worker.cancelled;
+
+                    if (authFinish() == 0) { /* successful authentication */
+                        setInputState(AINPUT_STATE_VALID);
+                        updateInputState(modules);
+                        return;
+                    }
+
+                    if (!cancelled)
+                        penalty_time = inputPenalty(modules, ++failures);
+                    keypress_time = alock_mtime();
+
                 }
 
-                /* wait a bit */
-                usleep(25000);
                 continue;
             }
         }
@@ -266,6 +762,7 @@ static void eventLoop(Display *display, struct aModules *modules) {
 #endif /* WITH_XBLIGHT */
 
             /* block until any key press event arrives */
+            updateInputState(modules);
             XMaskEvent(display, KeyPressMask | StructureNotifyMask, &ev);
 
 #if WITH_XBLIGHT
@@ -275,141 +772,362 @@ static void eventLoop(Display *display, struct aModules *modules) {
 #endif /* WITH_XBLIGHT */
         }
 
-        switch (ev.type) {
-        case KeyPress:
+        /* Process the event and all other already queued ones at once, so
+         * the input state is updated (and redrawn) once per wakeup. */
+        events = 0;
+        do {
+            events++;
+            switch (ev.type) {
+            case KeyPress:
+
+                /* ignore input during the penalty */
+                if (penalty_time) {
+                    debug("key input ignored due to penalty");
+                    break;
+                }
+
+                /* swallow up first key press to indicate "enter mode" */
+                if (keypress_time == 0) {
+                    setInputState(AINPUT_STATE_INIT);
+                    keypress_time = alock_mtime();
+                    pass_pos = pass_len = 0;
+                    pass[0] = '\0';
+                    break;
+                }
 
-            /* swallow up first key press to indicate "enter mode" */
-            if (keypress_time == 0) {
-                modules->input->setstate(AINPUT_STATE_INIT);
                 keypress_time = alock_mtime();
-                pass_pos = pass_len = 0;
-                pass[0] = '\0';
-                break;
-            }
+                clen = XLookupString(&ev.xkey, cbuf, sizeof(cbuf), &ks, NULL);
+                debug("key input: %lx, %d, `%.*s`", ks, clen, clen, cbuf);
+
+                /* terminal-like key remapping */
+                if (clen == 1 && iscntrl(cbuf[0]))
+                    switch (cbuf[0]) {
+                    case 0x03 /* Ctrl-C */ :
+                        ks = XK_Escape;
+                        break;
+                    case 0x08 /* Ctrl-H */ :
+                        ks = XK_BackSpace;
+                        break;
+                    case 0x0A /* Ctrl-J */ :
+                    case 0x0D /* Ctrl-M */ :
+                        ks = XK_Return;
+                        break;
+                    }
+
+                /* translate key press symbol */
+                ks = modules->input->keypress(ks);
+
+                switch (ks) {
+                case NoSymbol:
+                    break;
 
-            keypress_time = alock_mtime();
-            clen = XLookupString(&ev.xkey, cbuf, sizeof(cbuf), &ks, NULL);
-            debug("key input: %lx, %d, `%.*s`", ks, clen, clen, cbuf);
+                /* clear/initialize input buffer */
+                case XK_Escape:
+                case XK_Clear:
+                    pass_pos = pass_len = 0;
+                    pass[0] = '\0';
+                    /* The authentication itself can not be interrupted, so its
+                     * result will be discarded upon completion. */
+                    if (auth_worker.running && !auth_worker.cancelled) {
+                        debug("cancelling authentication");
+                        auth_worker.cancelled = 1;
+                        setInputState(AINPUT_STATE_INIT);
+                    }
+                    break;
+
+                /* input position navigation */
+                case XK_Begin:
+                case XK_Home:
+                    pass_pos = 0;
+                    break;
+                case XK_End:
+                    pass_pos = pass_len;
+                    break;
+                case XK_Left:
+                    if (pass_pos > 0)
+                        pass_pos--;
+                    break;
+                case XK_Right:
+                    if (pass_pos < pass_len)
+                        pass_pos++;
+                    break;
 
-            /* terminal-like key remapping */
-            if (clen == 1 && iscntrl(cbuf[0]))
-                switch (cbuf[0]) {
-                case 0x03 /* Ctrl-C */ :
-                    ks = XK_Escape;
+                /* remove entered characters */
+                case XK_Delete:
+                    if (pass_pos < pass_len) {
+                        wmemmove(&pass[pass_pos], &pass[pass_pos + 1], pass_len - pass_pos);
+                        pass_len--;
+                    }
                     break;
-                case 0x08 /* Ctrl-H */ :
-                    ks = XK_BackSpace;
+                case XK_BackSpace:
+                    if (pass_pos > 0) {
+                        wmemmove(&pass[pass_pos - 1], &pass[pass_pos], pass_len - pass_pos + 1);
+                        pass_pos--;
+                        pass_len--;
+                    }
                     break;
-                case 0x0A /* Ctrl-J */ :
-                case 0x0D /* Ctrl-M */ :
-                    ks = XK_Return;
+
+                /* input confirmation and authentication test */
+                case XK_KP_Enter:
+                case XK_Linefeed:
+                case XK_Return: {
+
+                    char rbuf[sizeof(pass)];
+                    unsigned long long t;
+                    int rv;
+
+                    /* only one authentication can be in flight */
+                    if (auth_worker.running) {
+                        debug("authentication in progress");
+                        break;
+                    }
+
+                    setInputState(AINPUT_STATE_CHECK);
+
+                    /* The result is collected upon the worker completion, in
+                     * the meantime we are still processing key presses. */
+                    if (authStart(modules->auth, pass) == 0) {
+                        memset(pass, 0, sizeof(pass));
+                        pass_pos = pass_len = 0;
+                        break;
+                    }
+
+                    debug("unable to start auth worker");
+                    updateInputState(modules);
+                    XFlush(display);
+                    wcstombs(rbuf, pass, sizeof(rbuf));
+                    t = alock_utime();
+                    rv = modules->auth->authenticate(rbuf);
+                    alock_trace_span("auth", "authenticate", t,
+                            "\"module\":\"%s\",\"result\":%d", modules->auth->m.name, rv);
+
+                    memset(rbuf, 0, sizeof(rbuf));
+                    memset(pass, 0, sizeof(pass));
+                    pass_pos = pass_len = 0;
+
+                    if (rv == 0) { /* successful authentication */
+                        setInputState(AINPUT_STATE_VALID);
+                        updateInputState(modules);
+                        return;
+                    }
+
+                    penalty_time = inputPenalty(modules, ++failures);
+                    keypress_time = alock_mtime();
+
                     break;
                 }
 
-            /* translate key press symbol */
-            ks = modules->input->keypress(ks);
+                /* input new character at the current input position */
+                default:
+                    if (clen > 0 && !iscntrl(cbuf[0]) && pass_len < (sizeof(pass) / sizeof(*pass) - 1)) {
+                        wmemmove(&pass[pass_pos + 1], &pass[pass_pos], pass_len - pass_pos + 1);
+                        mbtowc(&pass[pass_pos], cbuf, clen);
+                        pass_pos++;
+                        pass_len++;
+                    }
+                    break;
+                }
 
-            switch (ks) {
-            case NoSymbol:
+                debug("entered phrase [%zu]: `%ls`", wcslen(pass), pass);
                 break;
 
-            /* clear/initialize input buffer */
-            case XK_Escape:
-            case XK_Clear:
-                pass_pos = pass_len = 0;
-                pass[0] = '\0';
-                break;
+            case ConfigureNotify:
+                /* NOTE: This event should be generated for the root window upon
+                 *       the display reconfiguration (e.g. resolution change). */
 
-            /* input position navigation */
-            case XK_Begin:
-            case XK_Home:
-                pass_pos = 0;
-                break;
-            case XK_End:
-                pass_pos = pass_len;
-                break;
-            case XK_Left:
-                if (pass_pos > 0)
-                    pass_pos--;
-                break;
-            case XK_Right:
-                if (pass_pos < pass_len)
-                    pass_pos++;
+                debug("received configure notify event");
+                updateScreenGeometry(display, &ev.xconfigure);
                 break;
 
-            /* remove entered characters */
-            case XK_Delete:
-                if (pass_pos < pass_len) {
-                    wmemmove(&pass[pass_pos], &pass[pass_pos + 1], pass_len - pass_pos);
-                    pass_len--;
-                }
-                break;
-            case XK_BackSpace:
-                if (pass_pos > 0) {
-                    wmemmove(&pass[pass_pos - 1], &pass[pass_pos], pass_len - pass_pos + 1);
-                    pass_pos--;
-                    pass_len--;
-                }
+#if 0
+            case Expose:
+                XClearWindow(dpy, ((XExposeEvent*)&ev)->window);
                 break;
+#endif
 
-            /* input confirmation and authentication test */
-            case XK_KP_Enter:
-            case XK_Linefeed:
-            case XK_Return: {
+            }
+        } while (XCheckMaskEvent(display, KeyPressMask | StructureNotifyMask, &ev));
 
-                char rbuf[sizeof(pass)];
-                int rv;
+        if (events > 1)
+            debug("coalesced events: %u", events);
+        alock_trace_counter("input", "coalesced", events);
 
-                modules->input->setstate(AINPUT_STATE_CHECK);
+        updateInputState(modules);
+        XFlush(display);
 
-                wcstombs(rbuf, pass, sizeof(rbuf));
-                rv = modules->auth->authenticate(rbuf);
+    }
+}
 
-                memset(rbuf, 0, sizeof(rbuf));
-                memset(pass, 0, sizeof(pass));
-                pass_pos = pass_len = 0;
+/* Render the final content of background windows. When the display is
+ * already locked, windows are updated as soon as the content is ready. */
+static void renderBackground(Display *display, struct aModules *modules,
+        unsigned int deadline) {
 
-                if (rv == 0) { /* successful authentication */
-                    modules->input->setstate(AINPUT_STATE_VALID);
-                    return;
-                }
+    unsigned long long t = alock_utime();
+    int rv;
 
-                modules->input->setstate(AINPUT_STATE_ERROR);
-                modules->input->setstate(AINPUT_STATE_INIT);
-                keypress_time = alock_mtime();
+    rv = modules->background->render(deadline ? alock_mtime() + deadline : 0);
+    XFlush(display);
+    traceSync(display);
+    alock_trace_span("background", "render", t, "\"module\":\"%s\",\"result\":%d",
+            modules->background->m.name, rv);
 
-                break;
-            }
+}
+
+/* Lock the display, wait for the successful authentication and unlock the
+ * display afterwards. This function returns 0 on success, otherwise -1. */
+static int lockSession(Display *display, struct aModules *modules) {
+
+    unsigned long long t = alock_utime();
+    int rv;
 
-            /* input new character at the current input position */
+#if WITH_DUNST
+    /* pause notification daemon */
+    system("pkill -x -SIGUSR1 dunst");
+#endif
+
+    if (modules->background->capture())
+        fprintf(stderr, "alock: failed capture of [%s]\n", modules->background->m.name);
+    traceSync(display);
+    alock_trace_span("background", "capture", t, "\"module\":\"%s\"",
+            modules->background->m.name);
+
+    t = alock_utime();
+    rv = lockDisplay(display, modules);
+    alock_trace_span("main", "lockDisplay", t, "\"result\":%d", rv);
+
+    /* end-to-end latency from the process start until the display is locked */
+    if (startup_time) {
+        alock_trace_span("main", "startup", startup_time, "\"result\":%d", rv);
+        startup_time = 0;
+    }
+
+    if (rv == 0) {
+        renderBackground(display, modules, render_deadline);
+        eventLoop(display, modules);
+    }
+    unlockDisplay(display, modules);
+
+#if WITH_DUNST
+    /* resume notification daemon */
+    system("pkill -x -SIGUSR2 dunst");
+#endif
+
+    return rv;
+}
+
+/* Drain requests written to the signal pipe. Returns 2 if the termination
+ * has been requested, 1 if the lock has been requested, otherwise 0. */
+static int drainSignalPipe(void) {
+
+    char buffer[16];
+    ssize_t i, len;
+    int rv = 0;
+
+    while ((len = read(signal_pipe[0], buffer, sizeof(buffer))) > 0)
+        for (i = 0; i < len; i++)
+            if (buffer[i] == 'T')
+                rv = 2;
+            else if (rv == 0)
+                rv = 1;
+
+    return rv;
+}
+
+/* Wait for lock requests and lock the display accordingly. The lock can be
+ * requested by sending the SIGUSR1 signal to the process registered in the
+ * ALOCK_INSTANCE_PID property or by setting the ALOCK_LOCK_REQUEST property
+ * on the root window. Modules are reinitialized only if X resources or the
+ * screen geometry has changed. Upon the SIGTERM signal this function returns
+ * zero, so the instance can be unregistered. */
+static int daemonLoop(Display *display, struct aModules *modules,
+        const struct aModulesArgs *args) {
+
+    Atom atom = XInternAtom(display, "ALOCK_LOCK_REQUEST", False);
+    struct pollfd pfds[2] = {
+        { ConnectionNumber(display), POLLIN, 0 },
+        { signal_pipe[0], POLLIN, 0 },
+    };
+    int lock = 0;
+    XEvent ev;
+
+    debug("entering daemon main loop");
+    for (;;) {
+
+        while (XPending(display)) {
+            XNextEvent(display, &ev);
+            switch (ev.type) {
+            case PropertyNotify:
+                if (ev.xproperty.state != PropertyNewValue)
+                    break;
+                if (ev.xproperty.atom == atom) {
+                    XDeleteProperty(display, ev.xproperty.window, atom);
+                    lock = 1;
+                }
+                else if (ev.xproperty.atom == XA_RESOURCE_MANAGER)
+                    modules_outdated = 1;
+                break;
+            case ConfigureNotify:
+                updateScreenGeometry(display, &ev.xconfigure);
+                break;
             default:
-                if (clen > 0 && !iscntrl(cbuf[0]) && pass_len < (sizeof(pass) / sizeof(*pass) - 1)) {
-                    wmemmove(&pass[pass_pos + 1], &pass[pass_pos], pass_len - pass_pos + 1);
-                    mbtowc(&pass[pass_pos], cbuf, clen);
-                    pass_pos++;
-                    pass_len++;
+#if ENABLE_XRANDR
+                /* monitors might be rearranged within the same screen size */
+                if (xrandr_event_base != -1 &&
+                        (ev.type == xrandr_event_base + RRScreenChangeNotify ||
+                         ev.type == xrandr_event_base + RRNotify)) {
+                    XRRUpdateConfiguration(&ev);
+                    debug("monitor configuration changed");
+                    modules_outdated = 1;
                 }
+#endif
                 break;
             }
+        }
 
-            debug("entered phrase [%zu]: `%ls`", wcslen(pass), pass);
-            break;
+        if (lock) {
 
-        case ConfigureNotify:
-            /* NOTE: This event should be generated for the root window upon
-             *       the display reconfiguration (e.g. resolution change). */
+            if (modules_outdated) {
+                debug("reinitializing modules");
+                if (reloadModules(display, modules, args))
+                    return -1;
+                renderBackground(display, modules, 0);
+                modules_outdated = 0;
+            }
 
-            debug("received configure notify event");
-            break;
+            lockSession(display, modules);
 
-#if 0
-        case Expose:
-            XClearWindow(dpy, ((XExposeEvent*)&ev)->window);
-            break;
-#endif
+            /* discard lock requests received while the display was locked */
+            if (drainSignalPipe() == 2)
+                break;
+            while (XCheckTypedEvent(display, PropertyNotify, &ev))
+                if (ev.xproperty.atom == atom)
+                    XDeleteProperty(display, ev.xproperty.window, atom);
+                else if (ev.xproperty.atom == XA_RESOURCE_MANAGER)
+                    modules_outdated = 1;
+
+            lock = 0;
+            continue;
+        }
+
+        XFlush(display);
+        if (poll(pfds, 2, -1) == -1 && errno != EINTR) {
+            perror("alock: poll failed");
+            return -1;
+        }
 
+        if (pfds[1].revents & POLLIN) {
+            int rv = drainSignalPipe();
+            if (rv == 2)
+                break;
+            if (rv == 1)
+                lock = 1;
         }
+
     }
+
+    debug("termination requested");
+    return 0;
 }
 
 int main(int argc, char **argv) {
@@ -422,17 +1140,23 @@ int main(int argc, char **argv) {
         {"bg", required_argument, NULL, 'b'},
         {"cursor", required_argument, NULL, 'c'},
         {"input", required_argument, NULL, 'i'},
+        {"trace", required_argument, NULL, 't'},
+        {"daemon", no_argument, NULL, 'd'},
+        {"deadline", required_argument, NULL, 'r'},
+        {"grab-timeout", required_argument, NULL, 'g'},
+        {"threads", required_argument, NULL, 'j'},
         {0, 0, 0, 0},
     };
 
     Display *display;
     struct aModules modules;
+    unsigned long long t, t_start = alock_utime();
     int retval;
+    int i;
 
-    const char *args_auth = NULL;
-    const char *args_background = NULL;
-    const char *args_cursor = NULL;
-    const char *args_input = NULL;
+    struct aModulesArgs args = { NULL, NULL, NULL, NULL };
+    const char *trace_file = NULL;
+    int daemon_mode = 0;
 
     /* set-up default modules */
     modules.auth = alock_modules_auth[0];
@@ -445,11 +1169,12 @@ int main(int argc, char **argv) {
 #endif
 
     /* parse options */
-    while ((opt = getopt_long_only(argc, argv, "hma:b:c:i:", longopts, NULL)) != -1)
+    while ((opt = getopt_long_only(argc, argv, "hma:b:c:i:t:dr:g:j:", longopts, NULL)) != -1)
         switch (opt) {
         case 'h':
             printf("%s [-help] [-modules] [-auth type:options] [-bg type:options]"
-                    " [-cursor type:options] [-input type:options]\n", argv[0]);
+                    " [-cursor type:options] [-input type:options] [-trace file] [-daemon]"
+                    " [-deadline ms] [-grab-timeout ms] [-threads num]\n", argv[0]);
             return EXIT_SUCCESS;
 
         case 'm': { /* list available modules */
@@ -483,7 +1208,7 @@ int main(int argc, char **argv) {
             struct aModuleAuth **i;
             for (i = alock_modules_auth; *i; ++i)
                 if (strstr(optarg, (*i)->m.name) == optarg) {
-                    args_auth = optarg;
+                    args.auth = optarg;
                     modules.auth = *i;
                     break;
                 }
@@ -501,7 +1226,7 @@ int main(int argc, char **argv) {
             struct aModuleBackground **i;
             for (i = alock_modules_background; *i; ++i)
                 if (strstr(optarg, (*i)->m.name) == optarg) {
-                    args_background = optarg;
+                    args.background = optarg;
                     modules.background = *i;
                     break;
                 }
@@ -519,7 +1244,7 @@ int main(int argc, char **argv) {
             struct aModuleCursor **i;
             for (i = alock_modules_cursor; *i; ++i)
                 if (strstr(optarg, (*i)->m.name) == optarg) {
-                    args_cursor = optarg;
+                    args.cursor = optarg;
                     modules.cursor = *i;
                     break;
                 }
@@ -537,7 +1262,7 @@ int main(int argc, char **argv) {
             struct aModuleInput **i;
             for (i = alock_modules_input; *i; ++i)
                 if (strstr(optarg, (*i)->m.name) == optarg) {
-                    args_input = optarg;
+                    args.input = optarg;
                     modules.input = *i;
                     break;
                 }
@@ -550,43 +1275,76 @@ int main(int argc, char **argv) {
             break;
         }
 
+        case 't': /* trace events output file */
+            trace_file = optarg;
+            break;
+
+        case 'd': /* resident daemon mode */
+            daemon_mode = 1;
+            break;
+
+        case 'r': /* background rendering deadline */
+            render_deadline = strtoul(optarg, NULL, 0);
+            break;
+
+        case 'g': /* input devices grab time budget */
+            grab_timeout = strtoul(optarg, NULL, 0);
+            break;
+
+        case 'j': /* number of image processing threads */
+            alock_parallel_threads(strtoul(optarg, NULL, 0));
+            break;
+
         default:
             fprintf(stderr, "Try '%s --help' for more information.\n", argv[0]);
             return EXIT_FAILURE;
         }
 
+    if (alock_trace_open(trace_file))
+        return EXIT_FAILURE;
+
     /* required for correct input handling */
     setlocale(LC_ALL, "");
 
-    if ((display = XOpenDisplay(NULL)) == NULL) {
+    /* background modules might process screens in parallel */
+    XInitThreads();
+
+    t = alock_utime();
+    display = XOpenDisplay(NULL);
+    alock_trace_span("main", "XOpenDisplay", t, NULL);
+
+    if (display == NULL) {
         fprintf(stderr, "error: unable to connect to the X display\n");
+        alock_trace_close();
         return EXIT_FAILURE;
     }
 
+    /* Probe X server extensions before any worker thread is started. The
+     * probing temporarily replaces the X error handler, which is global. */
+    alock_probe_extensions(display);
+
     /* make sure, that only one instance of alock is running */
-    if (registerInstance(display)) {
+    t = alock_utime();
+    retval = registerInstance(display);
+    alock_trace_span("main", "registerInstance", t, NULL);
+
+    if (retval) {
         fprintf(stderr, "error: another instance seems to be running\n");
         XCloseDisplay(display);
+        alock_trace_close();
         return EXIT_FAILURE;
     }
 
-#if WITH_DUNST
-    /* pause notification daemon */
-    system("pkill -x -SIGUSR1 dunst");
-#endif
-
     { /* try to initialize selected modules */
 
         int rv = 0;
 
-        XrmInitialize();
-        const char *data = XResourceManagerString(display);
-        XrmDatabase xrdb = XrmGetStringDatabase(data != NULL ? data : "");
+        XrmDatabase xrdb = getResourceDatabase(display);
 
-        modules.auth->m.loadxrdb(xrdb);
-        modules.background->m.loadxrdb(xrdb);
-        modules.cursor->m.loadxrdb(xrdb);
-        modules.input->m.loadxrdb(xrdb);
+        moduleLoadxrdb("auth", &modules.auth->m, xrdb);
+        moduleLoadxrdb("background", &modules.background->m, xrdb);
+        moduleLoadxrdb("cursor", &modules.cursor->m, xrdb);
+        moduleLoadxrdb("input", &modules.input->m, xrdb);
 
 #if WITH_XBLIGHT
         XrmValue value;
@@ -599,52 +1357,89 @@ int main(int argc, char **argv) {
 
         XrmDestroyDatabase(xrdb);
 
-        modules.auth->m.loadargs(args_auth);
-        modules.background->m.loadargs(args_background);
-        modules.cursor->m.loadargs(args_cursor);
-        modules.input->m.loadargs(args_input);
+        moduleLoadargs("auth", &modules.auth->m, args.auth);
+        moduleLoadargs("background", &modules.background->m, args.background);
+        moduleLoadargs("cursor", &modules.cursor->m, args.cursor);
+        moduleLoadargs("input", &modules.input->m, args.input);
 
-        if (modules.auth->m.init(display)) {
-            fprintf(stderr, "alock: failed init of [%s] with [%s]\n",
-                    modules.auth->m.name, args_auth);
-            rv |= 1;
-        }
+        struct aModulesInit init = { display, &modules, &args };
 
 #if ENABLE_PASSWD
-        /* We can be installed setuid root to support shadow passwords,
-         * and we don't need root privileges any longer.  --marekm */
-        if (setuid(getuid()) != 0)
-            perror("alock: root privilege drop failed");
-#endif
-
-        if (modules.background->m.init(display)) {
-            fprintf(stderr, "alock: failed init of [%s] with [%s]\n",
-                    modules.background->m.name, args_background);
-            rv |= 1;
-        }
-        if (modules.cursor->m.init(display)) {
-            fprintf(stderr, "alock: failed init of [%s] with [%s]\n",
-                    modules.cursor->m.name, args_cursor);
-            rv |= 1;
-        }
-        if (modules.input->m.init(display)) {
-            fprintf(stderr, "alock: failed init of [%s] with [%s]\n",
-                    modules.input->m.name, args_input);
-            rv |= 1;
+        if (getuid() != geteuid()) {
+            /* Authentication module might require root privileges, however
+             * other modules shall not be initialized with such privileges,
+             * so in this case the initialization has to be sequential. */
+            rv |= initModules(AMODULES_GROUP_AUTH, &init);
+            /* We can be installed setuid root to support shadow passwords,
+             * and we don't need root privileges any longer.  --marekm */
+            if (setuid(getuid()) != 0)
+                perror("alock: root privilege drop failed");
+            rv |= initModules(AMODULES_GROUP_DISPLAY, &init);
         }
+        else
+#endif
+        /* Authentication module might block on NSS (e.g. LDAP) lookups,
+         * while others are bound by the X server, so initialize both groups
+         * in parallel. */
+        rv = alock_parallel(2, initModules, &init);
 
         if (rv) /* initialization failed */
             goto return_failure;
 
     }
 
-    /* raise our background window and grab input, if this action has failed,
-     * we are not able to lock the screen, then we're fucked... */
-    if (lockDisplay(display, &modules))
-        goto return_failure;
+    for (i = 0; i < ScreenCount(display); i++) {
+        /* receive notification about root window geometry change, and in the
+         * daemon mode about X resources change and lock requests */
+        XSelectInput(display, RootWindow(display, i), daemon_mode ?
+                StructureNotifyMask | PropertyChangeMask : StructureNotifyMask);
+    }
+
+#if ENABLE_XRANDR
+    {   /* in the daemon mode track monitor changes, which do not have to
+         * change the screen size (e.g. rotation or rearrangement) */
+        int tmp, major, minor;
+        if (daemon_mode && XRRQueryExtension(display, &xrandr_event_base, &tmp) &&
+                XRRQueryVersion(display, &major, &minor)) {
+            int mask = RRScreenChangeNotifyMask;
+            if (major > 1 || (major == 1 && minor >= 2))
+                mask |= RRCrtcChangeNotifyMask | RROutputChangeNotifyMask;
+            for (i = 0; i < ScreenCount(display); i++)
+                XRRSelectInput(display, RootWindow(display, i), mask);
+        }
+        else
+            xrandr_event_base = -1;
+    }
+#endif
+
+    if (daemon_mode) {
+
+        /* pre-render background windows, so the lock will be instant */
+        renderBackground(display, &modules, 0);
 
-    debug("entering main event loop");
-    eventLoop(display, &modules);
+        struct sigaction sa = { .sa_handler = signalHandler, .sa_flags = SA_RESTART };
+
+        if (pipe(signal_pipe) == -1) {
+            perror("alock: unable to create signal pipe");
+            goto return_failure;
+        }
+
+        for (i = 0; i < 2; i++)
+            fcntl(signal_pipe[i], F_SETFL, O_NONBLOCK);
+        sigaction(SIGUSR1, &sa, NULL);
+        sigaction(SIGTERM, &sa, NULL);
+
+        if (daemonLoop(display, &modules, &args))
+            goto return_failure;
+
+    }
+    else {
+        /* raise our background window and grab input, if this action has failed,
+         * we are not able to lock the screen, then we're fucked... */
+        startup_time = t_start;
+        if (lockSession(display, &modules))
+            goto return_failure;
+    }
 
     retval = EXIT_SUCCESS;
     goto return_success;
@@ -662,10 +1457,7 @@ return_success:
     unregisterInstance(display);
     XCloseDisplay(display);
 
-#if WITH_DUNST
-    /* resume notification daemon */
-    system("pkill -x -SIGUSR2 dunst");
-#endif
+    alock_trace_close();
 
     return retval;
 }
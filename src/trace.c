@@ -0,0 +1,155 @@
+/*
+ * alock - trace.c
+ * Copyright (c) 2014 - 2018 Arkadiusz Bokowy
+ *
+ * This file is a part of an alock.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ * Simple latency tracing facility. Collected events are written in the
+ * Trace Event Format (JSON array flavor), so the result can be loaded
+ * directly into the chrome://tracing viewer or any compatible tool.
+ *
+ */
+
+#include "alock.h"
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+static struct traceData {
+    FILE *file;
+    int pid;
+    int events;
+} data = { NULL, 0, 0 };
+
+
+/* Get the identifier of the calling thread. Identifiers are assigned in
+ * the order in which threads emit their first trace event. */
+static int trace_tid(void) {
+    static int counter = 0;
+    static __thread int tid = 0;
+    if (tid == 0)
+        tid = __sync_add_and_fetch(&counter, 1);
+    return tid;
+}
+
+/* Write event separator and common event fields. The stream has to be
+ * locked by the caller. */
+static void trace_event_header(const char *category, const char *name, char phase) {
+    fprintf(data.file, "%s\n{\"cat\":\"%s\",\"name\":\"%s\",\"ph\":\"%c\",\"pid\":%d,\"tid\":%d",
+            data.events++ ? "," : "", category, name, phase, data.pid, trace_tid());
+}
+
+/* Open given file for writing trace events. When the filename is NULL, the
+ * ALOCK_TRACE environment variable is consulted. This function returns 0 on
+ * success (or when tracing was not requested), otherwise -1. */
+int alock_trace_open(const char *filename) {
+
+    char hostname[64] = "";
+
+    if (filename == NULL && (filename = getenv("ALOCK_TRACE")) == NULL)
+        return 0;
+
+#if ENABLE_PASSWD
+    /* We might be installed setuid root, so make sure, that the trace file
+     * is created with the privileges of the invoking user. */
+    uid_t euid = geteuid();
+    if (seteuid(getuid()) != 0)
+        return -1;
+#endif
+
+    data.file = fopen(filename, "w");
+
+#if ENABLE_PASSWD
+    if (seteuid(euid) != 0)
+        perror("alock: privilege restore failed");
+#endif
+
+    if (data.file == NULL) {
+        perror("alock: unable to open trace file");
+        return -1;
+    }
+
+    data.pid = getpid();
+    data.events = 0;
+    gethostname(hostname, sizeof(hostname) - 1);
+
+    flockfile(data.file);
+    fprintf(data.file, "[");
+    trace_event_header("__metadata", "process_name", 'M');
+    fprintf(data.file, ",\"args\":{\"name\":\"alock %s\",\"host\":\"%s\"}}",
+            PACKAGE_VERSION, hostname);
+    funlockfile(data.file);
+
+    return 0;
+}
+
+/* Finalize trace events stream and close the trace file. */
+void alock_trace_close(void) {
+
+    if (data.file == NULL)
+        return;
+
+    fprintf(data.file, "\n]\n");
+    fclose(data.file);
+    data.file = NULL;
+
+}
+
+/* Check whether tracing is enabled. */
+int alock_trace_enabled(void) {
+    return data.file != NULL;
+}
+
+/* Record a complete event (span), which started at the given time-stamp
+ * (obtained with the alock_utime() function) and lasted until now. Optional
+ * args parameter is a printf-like format of the JSON object members, which
+ * will be attached to the event, e.g. "\"attempt\":%d". */
+void alock_trace_span(const char *category, const char *name,
+        unsigned long long start, const char *args, ...) {
+
+    if (data.file == NULL)
+        return;
+
+    unsigned long long now = alock_utime();
+    va_list ap;
+
+    flockfile(data.file);
+
+    trace_event_header(category, name, 'X');
+    fprintf(data.file, ",\"ts\":%llu,\"dur\":%llu", start, now - start);
+
+    if (args != NULL) {
+        fprintf(data.file, ",\"args\":{");
+        va_start(ap, args);
+        vfprintf(data.file, args, ap);
+        va_end(ap);
+        fprintf(data.file, "}");
+    }
+
+    fprintf(data.file, "}");
+    fflush(data.file);
+
+    funlockfile(data.file);
+
+}
+
+/* Record the value of the given counter at the current time. */
+void alock_trace_counter(const char *category, const char *name, long value) {
+
+    if (data.file == NULL)
+        return;
+
+    flockfile(data.file);
+
+    trace_event_header(category, name, 'C');
+    fprintf(data.file, ",\"ts\":%llu,\"args\":{\"value\":%ld}}", alock_utime(), value);
+    fflush(data.file);
+
+    funlockfile(data.file);
+
+}
@@ -13,18 +13,42 @@
 
 #include <ctype.h>
 #include <math.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
 #include <X11/Xutil.h>
+#if defined(__x86_64__) || defined(__i386__)
+# include <immintrin.h>
+#endif
 #if ENABLE_IMLIB2
 # include <Imlib2.h>
 #endif
 #if ENABLE_XRENDER
 # include <X11/extensions/Xrender.h>
 #endif
+#if ENABLE_XRANDR
+# include <X11/extensions/Xrandr.h>
+#endif
+#if HAVE_XEXT
+# include <sys/ipc.h>
+# include <sys/shm.h>
+# include <X11/extensions/XShm.h>
+#endif
+#include <sys/socket.h>
+
 
+/* names of the blur modes - see the aBlurMode enumeration */
+static const char *alock_blur_mode_names[ABLUR_MODE__MAX] = {
+    [ABLUR_MODE_DEFAULT] = "default",
+    [ABLUR_MODE_IMLIB] = "imlib",
+    [ABLUR_MODE_GAUSS2D] = "gauss2d",
+    [ABLUR_MODE_GAUSS] = "gauss",
+    [ABLUR_MODE_BOX] = "box",
+    [ABLUR_MODE_SCALE] = "scale",
+};
 
 /* Get system time-stamp in milliseconds without discontinuities. */
 unsigned long alock_mtime() {
@@ -38,12 +62,218 @@ unsigned long alock_mtime() {
     return t.tv_sec * 1000 + t.tv_nsec / 1000000;
 }
 
+/* Get system time-stamp in microseconds without discontinuities. */
+unsigned long long alock_utime() {
+    struct timespec t;
+#ifdef CLOCK_BOOTTIME
+    clock_gettime(CLOCK_BOOTTIME, &t);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &t);
+#endif
+    return t.tv_sec * 1000000ULL + t.tv_nsec / 1000;
+}
+
+/* Check whether the given deadline (the alock_mtime() time-stamp) has
+ * passed. All pending requests are processed by the X server beforehand,
+ * so the rendering time is taken into account. Zero deadline never passes. */
+int alock_deadline_passed(Display *display, unsigned long deadline) {
+    if (deadline == 0)
+        return 0;
+    XSync(display, False);
+    return alock_mtime() > deadline;
+}
+
+struct parallelTask {
+    int (*func)(unsigned int index, void *arg);
+    void *arg;
+    unsigned int count;
+    unsigned int next;
+    int status;
+};
+
+/* Maximal number of threads used by the alock_parallel() function, where
+ * zero stands for the number of available CPUs. */
+static unsigned int parallel_threads = 0;
+
+/* Minimal number of image rows processed by a single parallel call. */
+#define PARALLEL_ROWS_MIN 32
+
+struct parallelRows {
+    int (*kernel)(XImage *image, int x, int y,
+            unsigned int width, unsigned int height, void *arg);
+    void *arg;
+    XImage *image;
+    int x, y;
+    unsigned int width;
+    unsigned int height;
+    unsigned int band;
+};
+
+/* Worker thread of the alock_parallel() function. */
+static void *parallel_worker(void *arg) {
+
+    struct parallelTask *task = (struct parallelTask *)arg;
+    unsigned int i;
+
+    while ((i = __sync_fetch_and_add(&task->next, 1)) < task->count)
+        if (task->func(i, task->arg) != 0)
+            __sync_lock_test_and_set(&task->status, -1);
+
+    return NULL;
+}
+
+/* Call given function for every index in the range [0, count) using worker
+ * threads - at most one per available CPU. The calling thread takes part in
+ * the processing as well. Note, that functions which use X connection can be
+ * called in parallel only if the XInitThreads() was called. This function
+ * returns 0 when all calls succeeded, otherwise -1. */
+int alock_parallel(unsigned int count,
+        int (*func)(unsigned int index, void *arg),
+        void *arg) {
+
+    struct parallelTask task = { func, arg, count, 0, 0 };
+    long cpus = parallel_threads ? (long)parallel_threads : sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned int threads = cpus > 0 && (unsigned long)cpus < count ? cpus : count;
+    pthread_t *tids = NULL;
+    unsigned int i, n = 1;
+
+    if (threads > 1 && (tids = malloc(sizeof(*tids) * threads)) != NULL)
+        for (; n < threads; n++)
+            if (pthread_create(&tids[n], NULL, parallel_worker, &task) != 0)
+                break;
+
+    parallel_worker(&task);
+
+    for (i = 1; i < n; i++)
+        pthread_join(tids[i], NULL);
+    free(tids);
+
+    return task.status;
+}
+
+/* Set the maximal number of threads used for parallel processing. When the
+ * given value is zero, the number of available CPUs is used. */
+void alock_parallel_threads(unsigned int threads) {
+    parallel_threads = threads;
+}
+
+/* Call kernel for the given row band of the alock_parallel_rows(). */
+static int parallel_rows_worker(unsigned int index, void *arg) {
+    const struct parallelRows *rows = (struct parallelRows *)arg;
+    unsigned int y = index * rows->band;
+    unsigned int height = rows->height - y < rows->band ? rows->height - y : rows->band;
+    return rows->kernel(rows->image, rows->x, rows->y + y, rows->width, height, rows->arg);
+}
+
+/* Split given region of the image into row bands and call the kernel for
+ * every band in parallel - see the alock_parallel() function. Note, that
+ * bands are disjoint, so the kernel can modify the image in place, as long
+ * as it touches its own rows only. This function returns 0 when all calls
+ * succeeded, otherwise -1. */
+int alock_parallel_rows(XImage *image,
+        int x, int y,
+        unsigned int width,
+        unsigned int height,
+        int (*kernel)(XImage *image, int x, int y,
+            unsigned int width, unsigned int height, void *arg),
+        void *arg) {
+
+    struct parallelRows rows = { kernel, arg, image, x, y, width, height, height };
+    long cpus = parallel_threads ? (long)parallel_threads : sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (height == 0)
+        return 0;
+
+    /* Use a few bands per thread, so the load is balanced even if some of
+     * the threads are preempted, but keep bands reasonably large. */
+    if (cpus > 1) {
+        rows.band = (height + cpus * 4 - 1) / (cpus * 4);
+        if (rows.band < PARALLEL_ROWS_MIN)
+            rows.band = PARALLEL_ROWS_MIN;
+    }
+
+    return alock_parallel((height + rows.band - 1) / rows.band, parallel_rows_worker, &rows);
+}
+
 /* Determine the Endianness of the system. */
 int alock_native_byte_order() {
     int x = 1;
     return (*((char *) &x) == 1) ? LSBFirst : MSBFirst;
 }
 
+/* Get rectangles of active monitors of the given screen. Rectangles are
+ * clipped to the screen boundaries and duplicates (e.g. cloned outputs) are
+ * skipped. When the X Resize and Rotate Extension 1.5 is not available, the
+ * whole screen is reported as a single monitor. The result shall be freed
+ * with the free() function. This function returns the number of monitors. */
+int alock_get_monitors(Display *display,
+        int screen,
+        struct aMonitor **monitors) {
+
+    Screen *s = ScreenOfDisplay(display, screen);
+    const int width = WidthOfScreen(s);
+    const int height = HeightOfScreen(s);
+    int count = 0;
+
+#if ENABLE_XRANDR
+    XRRMonitorInfo *info;
+    int major, minor;
+    int tmp;
+
+    if (XRRQueryExtension(display, &tmp, &tmp) &&
+            XRRQueryVersion(display, &major, &minor) &&
+            (major > 1 || (major == 1 && minor >= 5)) &&
+            (info = XRRGetMonitors(display, RootWindowOfScreen(s), True, &tmp)) != NULL) {
+
+        if (tmp > 0 && (*monitors = malloc(sizeof(**monitors) * tmp)) != NULL) {
+            int i, j;
+            for (i = 0; i < tmp; i++) {
+
+                int x1 = info[i].x > 0 ? info[i].x : 0;
+                int y1 = info[i].y > 0 ? info[i].y : 0;
+                int x2 = info[i].x + info[i].width < width ? info[i].x + info[i].width : width;
+                int y2 = info[i].y + info[i].height < height ? info[i].y + info[i].height : height;
+
+                if (x2 <= x1 || y2 <= y1)
+                    continue;
+                for (j = 0; j < count; j++)
+                    if ((*monitors)[j].x == x1 && (*monitors)[j].y == y1 &&
+                            (*monitors)[j].width == (unsigned)(x2 - x1) &&
+                            (*monitors)[j].height == (unsigned)(y2 - y1))
+                        break;
+                if (j < count)
+                    continue;
+
+                (*monitors)[count].x = x1;
+                (*monitors)[count].y = y1;
+                (*monitors)[count].width = x2 - x1;
+                (*monitors)[count].height = y2 - y1;
+                count++;
+
+            }
+            if (count == 0)
+                free(*monitors);
+        }
+
+        XRRFreeMonitors(info);
+    }
+#endif /* ENABLE_XRANDR */
+
+    if (count > 0) {
+        debug("Screen %d monitors: %d", screen, count);
+        return count;
+    }
+
+    /* whole screen as a single monitor */
+    if ((*monitors = malloc(sizeof(**monitors))) == NULL)
+        return 0;
+    (*monitors)->x = 0;
+    (*monitors)->y = 0;
+    (*monitors)->width = width;
+    (*monitors)->height = height;
+    return 1;
+}
+
 /* Allocate colormap entry by the given color name. When the color_name
  * parameter is NULL, then fallback value is used right away. */
 int alock_alloc_color(Display *display,
@@ -63,26 +293,249 @@ int alock_alloc_color(Display *display,
     return 1;
 }
 
+/* Results of the X server extensions probing. */
+static struct {
+    pthread_mutex_t mutex;
+    int probed;
+    int xrender;
+    int xrender_major;
+    int xrender_minor;
+    int xshm;
+} extensions = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
 /* Check if the X server supports RENDER extension. */
 int alock_check_xrender(Display *display) {
-#if ENABLE_XRENDER
-    static int checked = 0;
-    static int available = 0;
+    alock_probe_extensions(display);
+    return extensions.xrender;
+}
+
+/* Check whether the X Render Extension supports at least the given version
+ * of the protocol. */
+int alock_check_xrender_version(Display *display, int major, int minor) {
+    alock_probe_extensions(display);
+    return extensions.xrender_major > major ||
+        (extensions.xrender_major == major && extensions.xrender_minor >= minor);
+}
+
+/* Check whether the connection with the X server is a local one, i.e. it
+ * goes through the UNIX domain socket. */
+int alock_local_connection(Display *display) {
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    return getsockname(ConnectionNumber(display), (struct sockaddr *)&addr, &len) == 0 &&
+        addr.ss_family == AF_UNIX;
+}
+
+#if HAVE_XEXT
+static int shm_error_code = 0;
+static int shm_error_handler(Display *display, XErrorEvent *event) {
+    (void)display;
+    shm_error_code = event->error_code;
+    return 0;
+}
+
+/* Check whether the MIT Shared Memory Extension can be used with the given
+ * display. The shared memory segment can be attached only by the X server
+ * running on the same machine, so the connection has to be a local one. */
+static int probe_xshm(Display *display) {
+
+    if (!alock_local_connection(display) || !XShmQueryExtension(display))
+        return 0;
 
-    if (checked)
-        return available;
+    /* Even for local connections, the X server might not be able to attach
+     * our segment (e.g. it runs in a different IPC namespace), so do a test
+     * run with a single-pixel image. */
+    Visual *visual = DefaultVisual(display, DefaultScreen(display));
+    int depth = DefaultDepth(display, DefaultScreen(display));
+    XImage *image;
 
+    if ((image = alock_create_image(display, visual, depth, 1, 1)) == NULL)
+        return 0;
+
+    XErrorHandler handler = XSetErrorHandler(shm_error_handler);
+    shm_error_code = 0;
+    XShmAttach(display, (XShmSegmentInfo *)image->obdata);
+    XSync(display, False);
+    XSetErrorHandler(handler);
+
+    if (shm_error_code == 0)
+        XShmDetach(display, (XShmSegmentInfo *)image->obdata);
+    alock_destroy_image(display, image);
+
+    return shm_error_code == 0;
+}
+#endif /* HAVE_XEXT */
+
+/* Probe X server extensions used by the helper functions. Results are cached,
+ * so subsequent calls are cheap. Note, that the probing replaces the process
+ * wide X error handler for a while, so this function shall be called from the
+ * main thread before any worker thread is started. */
+void alock_probe_extensions(Display *display) {
+
+    pthread_mutex_lock(&extensions.mutex);
+    if (extensions.probed) {
+        pthread_mutex_unlock(&extensions.mutex);
+        return;
+    }
+
+#if ENABLE_XRENDER
     int tmp;
-    checked = 1;
+    if ((extensions.xrender = XRenderQueryExtension(display, &tmp, &tmp)) &&
+            !XRenderQueryVersion(display, &extensions.xrender_major, &extensions.xrender_minor))
+        extensions.xrender_major = extensions.xrender_minor = 0;
+#endif
+
+#if HAVE_XEXT
+    extensions.xshm = probe_xshm(display);
+#endif
+
+    (void)display;
+    extensions.probed = 1;
+    pthread_mutex_unlock(&extensions.mutex);
 
-    if ((available = XRenderQueryExtension(display, &tmp, &tmp)) == False)
-        fprintf(stderr, "alock: missing X Render Extension support\n");
+    debug("X Render available: %d (%d.%d)", extensions.xrender,
+            extensions.xrender_major, extensions.xrender_minor);
+    debug("MIT-SHM available: %d", extensions.xshm);
+}
+
+/* Check whether the MIT Shared Memory Extension can be used. */
+int alock_check_xshm(Display *display) {
+    alock_probe_extensions(display);
+    return extensions.xshm;
+}
+
+/* Create Z-format image backed by the shared memory segment. The segment is
+ * not attached to the X server. Such an image has to be released with the
+ * alock_destroy_image() function. */
+XImage *alock_create_image(Display *display,
+        Visual *visual,
+        int depth,
+        unsigned int width,
+        unsigned int height) {
+#if HAVE_XEXT
+
+    XShmSegmentInfo *shminfo;
+    XImage *image;
 
-    return available;
+    if ((shminfo = (XShmSegmentInfo *)malloc(sizeof(*shminfo))) == NULL)
+        return NULL;
+
+    image = XShmCreateImage(display, visual, depth, ZPixmap, NULL, shminfo, width, height);
+    if (image == NULL)
+        goto fail;
+
+    shminfo->shmid = shmget(IPC_PRIVATE, image->bytes_per_line * image->height, IPC_CREAT | 0600);
+    if (shminfo->shmid == -1)
+        goto fail;
+
+    shminfo->shmaddr = image->data = (char *)shmat(shminfo->shmid, NULL, 0);
+    shminfo->readOnly = False;
+    /* Mark segment for removal right away, so it will not leak in case of
+     * a crash. It is kept until the last process detaches from it. */
+    shmctl(shminfo->shmid, IPC_RMID, NULL);
+
+    if (shminfo->shmaddr == (char *)-1)
+        goto fail;
+
+    return image;
+
+fail:
+    if (image == NULL)
+        free(shminfo);
+    else {
+        /* segment info is released together with the image */
+        image->data = NULL;
+        XDestroyImage(image);
+    }
+    return NULL;
 #else
     (void)display;
-    return 0;
-#endif /* ENABLE_XRENDER */
+    (void)visual;
+    (void)depth;
+    (void)width;
+    (void)height;
+    return NULL;
+#endif /* HAVE_XEXT */
+}
+
+/* Release image obtained with the alock_get_image() or alock_create_image()
+ * function. */
+void alock_destroy_image(Display *display, XImage *image) {
+#if HAVE_XEXT
+    XShmSegmentInfo *shminfo;
+    if ((shminfo = (XShmSegmentInfo *)image->obdata) != NULL) {
+        /* segment info (obdata) is released by the XDestroyImage() */
+        shmdt(shminfo->shmaddr);
+        image->data = NULL;
+    }
+#endif
+    (void)display;
+    XDestroyImage(image);
+}
+
+/* Get the image of the given drawable. If possible, the MIT Shared Memory
+ * Extension is used, so the image data is not transferred over the socket.
+ * Otherwise, this function falls back to the XGetImage(). */
+XImage *alock_get_image(Display *display,
+        Drawable drawable,
+        Visual *visual,
+        int depth,
+        int x, int y,
+        unsigned int width,
+        unsigned int height) {
+#if HAVE_XEXT
+    XShmSegmentInfo *shminfo;
+    XImage *image;
+
+    if (alock_check_xshm(display) &&
+            (image = alock_create_image(display, visual, depth, width, height)) != NULL) {
+
+        shminfo = (XShmSegmentInfo *)image->obdata;
+        XShmAttach(display, shminfo);
+
+        Status status = XShmGetImage(display, drawable, image, x, y, AllPlanes);
+        XShmDetach(display, shminfo);
+
+        if (status)
+            return image;
+
+        /* detach request has to be processed before the segment is gone */
+        XSync(display, False);
+        alock_destroy_image(display, image);
+    }
+#else
+    (void)visual;
+    (void)depth;
+#endif /* HAVE_XEXT */
+    return XGetImage(display, drawable, x, y, width, height, AllPlanes, ZPixmap);
+}
+
+/* Put the image (or its part) onto the given drawable. Images backed by the
+ * shared memory segment are uploaded with the MIT Shared Memory Extension.
+ * Note, that this function waits until the X server has processed the data,
+ * so the image can be modified or destroyed right after this call. */
+void alock_put_image(Display *display,
+        Drawable drawable,
+        GC gc,
+        XImage *image,
+        int src_x, int src_y,
+        int dst_x, int dst_y,
+        unsigned int width,
+        unsigned int height) {
+#if HAVE_XEXT
+    XShmSegmentInfo *shminfo;
+    if ((shminfo = (XShmSegmentInfo *)image->obdata) != NULL) {
+        XShmAttach(display, shminfo);
+        XShmPutImage(display, drawable, gc, image, src_x, src_y,
+                dst_x, dst_y, width, height, False);
+        XShmDetach(display, shminfo);
+        XSync(display, False);
+        return;
+    }
+#endif
+    XPutImage(display, drawable, gc, image, src_x, src_y, dst_x, dst_y, width, height);
 }
 
 /* Shade given source pixmap by the amount specified by the shade parameter,
@@ -161,11 +614,129 @@ int alock_shade_pixmap(Display *display,
 #endif /* ENABLE_XRENDER */
 }
 
-/* Blur given source pixmap using a Gaussian convolution filter. Whole
- * operation is performed by the X server and when possible hardware
- * accelerated. For the best results the blur parameter should be in the
- * range [0, 100]. */
-int alock_blur_pixmap(Display *display,
+/* Blend the given color over the pixmap region. The result is the same as
+ * for the alock_shade_pixmap() with the destination pixmap filled with this
+ * color, however no intermediate pixmap is required. */
+int alock_tint_pixmap(Display *display,
+        Visual *visual,
+        Pixmap pixmap,
+        const XColor *color,
+        unsigned char shade,
+        int x, int y,
+        unsigned int width,
+        unsigned int height) {
+#if ENABLE_XRENDER
+
+    if (shade > 100)
+        shade = 100;
+
+    /* color components have to be premultiplied by alpha */
+    const unsigned long alpha = 0xffff * (100 - shade) / 100;
+    XRenderColor tint = {
+        .red = color->red * alpha / 0xffff,
+        .green = color->green * alpha / 0xffff,
+        .blue = color->blue * alpha / 0xffff,
+        .alpha = alpha,
+    };
+
+    XRenderPictFormat *format = XRenderFindVisualFormat(display, visual);
+    Picture pic = XRenderCreatePicture(display, pixmap, format, 0, NULL);
+    XRenderFillRectangle(display, PictOpOver, pic, &tint, x, y, width, height);
+    XRenderFreePicture(display, pic);
+
+    return 1;
+#else
+    (void)display;
+    (void)visual;
+    (void)pixmap;
+    (void)color;
+    (void)shade;
+    (void)x;
+    (void)y;
+    (void)width;
+    (void)height;
+    return 0;
+#endif /* ENABLE_XRENDER */
+}
+
+#if ENABLE_XRENDER
+/* Scale the source picture into the destination one using the given filter
+ * (e.g. FilterBilinear). The whole destination picture area is filled. */
+static void xrender_scale_picture(Display *display,
+        Picture src_pic, int src_x, int src_y,
+        unsigned int src_width, unsigned int src_height,
+        Picture dst_pic, int dst_x, int dst_y,
+        unsigned int dst_width, unsigned int dst_height,
+        const char *filter) {
+
+    /* Transformation maps destination coordinates to the source ones. The
+     * source offset is a part of the transformation, so it is not truncated
+     * to the destination pixel grid. */
+    XTransform xform = {{
+        { XDoubleToFixed((double)src_width / dst_width), 0, XDoubleToFixed(src_x) },
+        { 0, XDoubleToFixed((double)src_height / dst_height), XDoubleToFixed(src_y) },
+        { 0, 0, XDoubleToFixed(1) },
+    }};
+
+    XRenderSetPictureTransform(display, src_pic, &xform);
+    XRenderSetPictureFilter(display, src_pic, filter, NULL, 0);
+    XRenderComposite(display, PictOpSrc, src_pic, None, dst_pic,
+                     0, 0, 0, 0, dst_x, dst_y, dst_width, dst_height);
+
+}
+
+#endif /* ENABLE_XRENDER */
+
+/* Scale the whole source pixmap into the destination pixmap region on the
+ * server side. The filter parameter is the name of the X Render filter,
+ * e.g. "nearest", "bilinear" or "best". This function returns 1 on success,
+ * otherwise 0. */
+int alock_scale_pixmap(Display *display,
+        Visual *visual,
+        const Pixmap src_pm,
+        unsigned int src_width,
+        unsigned int src_height,
+        Pixmap dst_pm,
+        int dst_x, int dst_y,
+        unsigned int dst_width,
+        unsigned int dst_height,
+        const char *filter) {
+#if ENABLE_XRENDER
+
+    if (!alock_check_xrender(display))
+        return 0;
+
+    XRenderPictFormat *format = XRenderFindVisualFormat(display, visual);
+    XRenderPictureAttributes pa = { .repeat = RepeatPad };
+    Picture src_pic = XRenderCreatePicture(display, src_pm, format, CPRepeat, &pa);
+    Picture dst_pic = XRenderCreatePicture(display, dst_pm, format, 0, NULL);
+
+    xrender_scale_picture(display, src_pic, 0, 0, src_width, src_height,
+            dst_pic, dst_x, dst_y, dst_width, dst_height, filter);
+
+    XRenderFreePicture(display, dst_pic);
+    XRenderFreePicture(display, src_pic);
+
+    return 1;
+#else
+    (void)display;
+    (void)visual;
+    (void)src_pm;
+    (void)src_width;
+    (void)src_height;
+    (void)dst_pm;
+    (void)dst_x;
+    (void)dst_y;
+    (void)dst_width;
+    (void)dst_height;
+    (void)filter;
+    return 0;
+#endif /* ENABLE_XRENDER */
+}
+
+#if ENABLE_IMLIB2
+/* Blur pixmap on the client side with the Imlib2 library. */
+static int blur_imlib(Display *display,
         Visual *visual,
         const Pixmap src_pm,
         Pixmap dst_pm,
@@ -175,11 +746,9 @@ int alock_blur_pixmap(Display *display,
         unsigned int width,
         unsigned int height) {
 
-    if (!blur)
-        /* TODO: copy source pixmap to the destination one */
-        return 1;
-
-#if ENABLE_IMLIB2
+    /* Imlib2 uses global context stack, so it is not thread-safe */
+    static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    pthread_mutex_lock(&mutex);
 
     Imlib_Context ctx = imlib_context_new();
 
@@ -195,41 +764,320 @@ int alock_blur_pixmap(Display *display,
 
     imlib_context_set_drawable(dst_pm);
     imlib_render_image_on_drawable_at_size(dst_x, dst_y, width, height);
+    imlib_free_image();
 
     imlib_context_pop();
     imlib_context_free(ctx);
+
+    pthread_mutex_unlock(&mutex);
     return 1;
+}
+#endif /* ENABLE_IMLIB2 */
 
-#elif ENABLE_XRENDER
+/* Get the standard deviation of the Gaussian blur for the given blur amount.
+ *
+ * NOTE: It seems that reasonable sigma value is between 0.5 and 4. This
+ *       will translate into the blur up to 12 x 12 pixels wide - radius
+ *       is like 3x times the sigma. */
+static double blur_sigma(unsigned char blur) {
+    return (double)blur / 30 + 0.5;
+}
 
-    /* NOTE: It seems that reasonable sigma value is between 0.5 and 4. This
-     *       will translate into the blur up to 12 x 12 pixels wide - radius
-     *       is like 3x times the sigma. */
-    double sigma = (double)blur / 30 + 0.5;
+/* Get the radius of the Gaussian kernel for the given standard deviation.
+ * Weights beyond the radius are below the 8-bit color precision. */
+static int blur_gauss_radius(double sigma) {
     int radius = sigma * sqrt(2 * -log(1.0 / 255));
-    int size = radius * 2 + 1;
+    return radius > 0 ? radius : 1;
+}
 
-    debug("Gaussian kernel size: %dx%d", size, size);
-    XFixed *params = malloc(sizeof(XFixed) * (2 + size * size));
+/* default and maximal number of levels of the scaling blur pyramid */
+#define BLUR_SCALE_LEVELS_DEFAULT 2
+#define BLUR_SCALE_LEVELS_MAX 8
+/* number of box blur passes used for the Gaussian blur approximation */
+#define BLUR_BOX_PASSES 3
+/* minimal width of the column band processed by a single parallel call */
+#define BLUR_BOX_COLUMNS_MIN 16
 
-    { /* calculate sampled Gaussian kernel */
-        double *kernel = malloc(sizeof(double) * size * size);
-        double scale1 = - 1.0 / (2 * sigma * sigma);
-        double scale2 = - scale1 / M_PI;
-        double vsum = 0;
-        int i, x, y;
+struct blurBox {
+    XImage *image;
+    void (*row)(uint8_t *row, const uint8_t *src, int width, int radius);
+    int radii[BLUR_BOX_PASSES];
+    unsigned int band;
+};
+
+/* Calculate box radii for every pass, so the result of all passes will
+ * approximate the Gaussian blur with the given standard deviation. */
+static void blur_box_radii(double sigma, int radii[BLUR_BOX_PASSES]) {
+
+    const int n = BLUR_BOX_PASSES;
+    int wl = sqrt(12 * sigma * sigma / n + 1);
+    int i, m;
+
+    if (wl % 2 == 0)
+        wl--;
+    m = round((12 * sigma * sigma - n * wl * wl - 4 * n * wl - 3 * n) / (-4 * wl - 4));
+
+    for (i = 0; i < n; i++)
+        radii[i] = ((i < m ? wl : wl + 2) - 1) / 2;
+
+}
+
+/* Check whether the color channel occupies exactly one byte. */
+static int blur_box_byte_mask(unsigned long mask) {
+    return mask == 0xff || mask == 0xff00 || mask == 0xff0000 || mask == 0xff000000;
+}
+
+/* Blur single row of 32bpp pixels with the running sum box filter. Every
+ * byte of the pixel is treated as a separate channel. The src parameter is
+ * a copy of the row, which is used as an input. */
+static void blur_box_row(uint8_t *row, const uint8_t *src, int width, int radius) {
+
+    const uint32_t inv = 65536 / (2 * radius + 1);
+    const int last = width - 1;
+    uint32_t sum[4];
+    int x, c;
+
+    for (c = 0; c < 4; c++) {
+        sum[c] = (radius + 1) * src[c];
+        for (x = 1; x <= radius; x++)
+            sum[c] += src[(x < last ? x : last) * 4 + c];
+    }
+
+    for (x = 0; x < width; x++) {
+        const uint8_t *add = &src[(x + radius + 1 < last ? x + radius + 1 : last) * 4];
+        const uint8_t *sub = &src[(x - radius > 0 ? x - radius : 0) * 4];
+        for (c = 0; c < 4; c++) {
+            row[x * 4 + c] = (sum[c] * inv + 32768) >> 16;
+            sum[c] += add[c] - sub[c];
+        }
+    }
+
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+
+/* SSE2 variant of the row box filter. Running sums of all four channels are
+ * kept in a single register. */
+__attribute__ ((target ("sse2")))
+static void blur_box_row_sse2(uint8_t *row, const uint8_t *src, int width, int radius) {
+
+    const __m128 inv = _mm_set1_ps(1.0f / (2 * radius + 1));
+    const __m128i zero = _mm_setzero_si128();
+    const int last = width - 1;
+    __m128i sum;
+    int x;
+
+#define BLUR_BOX_LOAD(i) _mm_unpacklo_epi16(_mm_unpacklo_epi8( \
+            _mm_cvtsi32_si128(*(const int32_t *)&src[(i) * 4]), zero), zero)
+
+    sum = _mm_mullo_epi16(BLUR_BOX_LOAD(0), _mm_set1_epi32(radius + 1));
+    for (x = 1; x <= radius; x++)
+        sum = _mm_add_epi32(sum, BLUR_BOX_LOAD(x < last ? x : last));
+
+    for (x = 0; x < width; x++) {
+        __m128i v = _mm_cvtps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(sum), inv));
+        v = _mm_packus_epi16(_mm_packs_epi32(v, zero), zero);
+        *(int32_t *)&row[x * 4] = _mm_cvtsi128_si32(v);
+        sum = _mm_add_epi32(sum, BLUR_BOX_LOAD(x + radius + 1 < last ? x + radius + 1 : last));
+        sum = _mm_sub_epi32(sum, BLUR_BOX_LOAD(x - radius > 0 ? x - radius : 0));
+    }
+
+#undef BLUR_BOX_LOAD
+
+}
+
+#endif
+
+/* Select the fastest row box filter supported by the running CPU. */
+static void (*blur_box_row_kernel(void))(uint8_t *, const uint8_t *, int, int) {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2"))
+        return blur_box_row_sse2;
+#endif
+    return blur_box_row;
+}
+
+/* Blur rows of the given band - see alock_parallel_rows(). */
+static int blur_box_rows(XImage *image, int x, int y,
+        unsigned int width, unsigned int height, void *arg) {
+
+    const struct blurBox *box = (struct blurBox *)arg;
+    uint8_t *buffer;
+    unsigned int _y;
+    int i;
+
+    if ((buffer = malloc(width * 4)) == NULL)
+        return -1;
+
+    for (_y = y; _y < y + height; _y++) {
+        uint8_t *row = (uint8_t *)image->data + _y * image->bytes_per_line + x * 4;
+        for (i = 0; i < BLUR_BOX_PASSES; i++) {
+            memcpy(buffer, row, width * 4);
+            box->row(row, buffer, width, box->radii[i]);
+        }
+    }
+
+    free(buffer);
+    return 0;
+}
+
+/* Blur columns of the given band. Running sums of all columns within the
+ * band are updated row by row, so the memory is accessed sequentially and
+ * the inner loops can be vectorized by the compiler. */
+static int blur_box_columns(unsigned int index, void *arg) {
+
+    const struct blurBox *box = (struct blurBox *)arg;
+    XImage *image = box->image;
+    const unsigned int x = index * box->band;
+    const unsigned int n = (image->width - x < box->band ? image->width - x : box->band) * 4;
+    const int last = image->height - 1;
+    uint8_t *buffer;
+    uint32_t *sum;
+    int i, y, r;
+    unsigned int k;
+
+    buffer = malloc(n * image->height);
+    sum = malloc(sizeof(*sum) * n);
+    if (buffer == NULL || sum == NULL) {
+        free(buffer);
+        free(sum);
+        return -1;
+    }
+
+    for (i = 0; i < BLUR_BOX_PASSES; i++) {
+
+        const int radius = box->radii[i];
+        const uint32_t inv = 65536 / (2 * radius + 1);
+
+        for (y = 0; y <= last; y++)
+            memcpy(&buffer[y * n], &image->data[y * image->bytes_per_line + x * 4], n);
+
+        for (k = 0; k < n; k++)
+            sum[k] = (radius + 1) * buffer[k];
+        for (r = 1; r <= radius; r++) {
+            const uint8_t *src = &buffer[(r < last ? r : last) * n];
+            for (k = 0; k < n; k++)
+                sum[k] += src[k];
+        }
 
-        for (i = 0, x = -radius; x <= radius; x++)
-            for (y = -radius; y <= radius; y++, i++) {
-                kernel[i] = scale2 * exp(scale1 * (x * x + y * y));
-                vsum += kernel[i];
+        for (y = 0; y <= last; y++) {
+            uint8_t *row = (uint8_t *)&image->data[y * image->bytes_per_line + x * 4];
+            const uint8_t *add = &buffer[(y + radius + 1 < last ? y + radius + 1 : last) * n];
+            const uint8_t *sub = &buffer[(y - radius > 0 ? y - radius : 0) * n];
+            for (k = 0; k < n; k++) {
+                row[k] = (sum[k] * inv + 32768) >> 16;
+                sum[k] += add[k] - sub[k];
             }
+        }
 
-        params[0] = params[1] = XDoubleToFixed(size);
-        for (i = 0; i < size * size; i++)
-            params[i + 2] = XDoubleToFixed(kernel[i] / vsum);
+    }
+
+    free(buffer);
+    free(sum);
+    return 0;
+}
+
+/* Blur pixmap on the client side with a few box blur passes, which give a
+ * good approximation of the Gaussian blur. Running sums are used, so the
+ * cost per pixel does not depend on the blur radius. Only 32bpp images with
+ * 8-bit channels are supported. */
+static int blur_box(Display *display,
+        Visual *visual,
+        const Pixmap src_pm,
+        Pixmap dst_pm,
+        unsigned char blur,
+        int src_x, int src_y,
+        int dst_x, int dst_y,
+        unsigned int width,
+        unsigned int height) {
+
+    struct blurBox box = { .row = blur_box_row_kernel(), .band = BLUR_BOX_COLUMNS_MIN };
+    unsigned int tmp, depth;
+    long cpus = parallel_threads ? (long)parallel_threads : sysconf(_SC_NPROCESSORS_ONLN);
+    Window root;
+    int itmp;
+    GC gc;
 
-        free(kernel);
+    XGetGeometry(display, src_pm, &root, &itmp, &itmp, &tmp, &tmp, &tmp, &depth);
+    box.image = alock_get_image(display, src_pm, visual, depth, src_x, src_y, width, height);
+    if (box.image == NULL)
+        return 0;
+
+    if (box.image->bits_per_pixel != 32 ||
+            !blur_box_byte_mask(box.image->red_mask) ||
+            !blur_box_byte_mask(box.image->green_mask) ||
+            !blur_box_byte_mask(box.image->blue_mask)) {
+        debug("Box blur: unsupported image format");
+        alock_destroy_image(display, box.image);
+        return 0;
+    }
+
+    blur_box_radii(blur_sigma(blur), box.radii);
+    debug("Box blur radii: %d, %d, %d", box.radii[0], box.radii[1], box.radii[2]);
+
+    /* split columns evenly among available CPUs */
+    if (cpus > 1 && width / cpus > box.band)
+        box.band = (width + cpus - 1) / cpus;
+
+    alock_parallel_rows(box.image, 0, 0, width, height, blur_box_rows, &box);
+    alock_parallel((width + box.band - 1) / box.band, blur_box_columns, &box);
+
+    gc = XCreateGC(display, dst_pm, 0, NULL);
+    alock_put_image(display, dst_pm, gc, box.image, 0, 0, dst_x, dst_y, width, height);
+    XFreeGC(display, gc);
+
+    alock_destroy_image(display, box.image);
+    return 1;
+}
+
+#if ENABLE_XRENDER
+/* Calculate sampled and normalized 1D Gaussian kernel for the given standard
+ * deviation. The size of the kernel (which is always odd) is stored in the
+ * size parameter. Returned kernel shall be freed with the free(). */
+static double *blur_gauss_kernel(double sigma, int *size) {
+
+    int radius = blur_gauss_radius(sigma);
+    double scale = - 1.0 / (2 * sigma * sigma);
+    double *kernel;
+    double vsum = 0;
+    int i, x;
+
+    *size = radius * 2 + 1;
+    kernel = malloc(sizeof(double) * *size);
+
+    for (i = 0, x = -radius; x <= radius; x++, i++)
+        vsum += kernel[i] = exp(scale * x * x);
+    for (i = 0; i < *size; i++)
+        kernel[i] /= vsum;
+
+    return kernel;
+}
+
+/* Blur pixmap with the X Render convolution filter using 2D kernel. */
+static int blur_xrender_gauss2d(Display *display,
+        Visual *visual,
+        const Pixmap src_pm,
+        Pixmap dst_pm,
+        unsigned char blur,
+        int src_x, int src_y,
+        int dst_x, int dst_y,
+        unsigned int width,
+        unsigned int height) {
+
+    int size;
+    double *kernel = blur_gauss_kernel(blur_sigma(blur), &size);
+
+    debug("Gaussian kernel size: %dx%d", size, size);
+    XFixed *params = malloc(sizeof(XFixed) * (2 + size * size));
+
+    { /* Gaussian function is separable, so the 2D kernel is an outer
+       * product of two 1D kernels */
+        int i, x, y;
+        params[0] = params[1] = XDoubleToFixed(size);
+        for (i = 2, x = 0; x < size; x++)
+            for (y = 0; y < size; y++, i++)
+                params[i] = XDoubleToFixed(kernel[x] * kernel[y]);
     }
 
     { /* 2D blur using convolution filter */
@@ -250,14 +1098,518 @@ int alock_blur_pixmap(Display *display,
         XRenderFreePicture(display, dst_pic);
     }
 
+    free(kernel);
     free(params);
     return 1;
+}
 
+/* Blur pixmap with the X Render convolution filter in two passes - the
+ * horizontal one and the vertical one. The result is the same as for the
+ * 2D kernel, however the cost per pixel is linear with the kernel size. The
+ * blur is specified directly by the standard deviation of the kernel. */
+static int blur_xrender_gauss_sigma(Display *display,
+        Visual *visual,
+        const Pixmap src_pm,
+        Pixmap dst_pm,
+        double sigma,
+        int src_x, int src_y,
+        int dst_x, int dst_y,
+        unsigned int width,
+        unsigned int height) {
+
+    int size;
+    double *kernel = blur_gauss_kernel(sigma, &size);
+
+    debug("Gaussian kernel size: %dx1 + 1x%d", size, size);
+    XFixed *params = malloc(sizeof(XFixed) * (2 + size));
+
+    {
+        XRenderPictFormat *format;
+        Picture src_pic;
+        Picture tmp_pic;
+        Picture dst_pic;
+        Pixmap tmp_pm;
+        int i;
+
+        for (i = 0; i < size; i++)
+            params[i + 2] = XDoubleToFixed(kernel[i]);
+
+        format = XRenderFindVisualFormat(display, visual);
+        tmp_pm = XCreatePixmap(display, dst_pm, width, height, format->depth);
+        src_pic = XRenderCreatePicture(display, src_pm, format, 0, NULL);
+        tmp_pic = XRenderCreatePicture(display, tmp_pm, format, 0, NULL);
+        dst_pic = XRenderCreatePicture(display, dst_pm, format, 0, NULL);
+
+        /* horizontal pass into the intermediate pixmap */
+        params[0] = XDoubleToFixed(size);
+        params[1] = XDoubleToFixed(1);
+        XRenderSetPictureFilter(display, src_pic, FilterConvolution,
+                                params, 2 + size);
+        XRenderComposite(display, PictOpSrc, src_pic, None, tmp_pic,
+                         src_x, src_y, 0, 0, 0, 0, width, height);
+
+        /* vertical pass into the destination pixmap */
+        params[0] = XDoubleToFixed(1);
+        params[1] = XDoubleToFixed(size);
+        XRenderSetPictureFilter(display, tmp_pic, FilterConvolution,
+                                params, 2 + size);
+        XRenderComposite(display, PictOpSrc, tmp_pic, None, dst_pic,
+                         0, 0, 0, 0, dst_x, dst_y, width, height);
+
+        XRenderFreePicture(display, src_pic);
+        XRenderFreePicture(display, tmp_pic);
+        XRenderFreePicture(display, dst_pic);
+        XFreePixmap(display, tmp_pm);
+    }
+
+    free(kernel);
+    free(params);
+    return 1;
+}
+
+/* Blur pixmap with the separable Gaussian kernel - see the function above. */
+static int blur_xrender_gauss(Display *display,
+        Visual *visual,
+        const Pixmap src_pm,
+        Pixmap dst_pm,
+        unsigned char blur,
+        int src_x, int src_y,
+        int dst_x, int dst_y,
+        unsigned int width,
+        unsigned int height) {
+    return blur_xrender_gauss_sigma(display, visual, src_pm, dst_pm, blur_sigma(blur),
+            src_x, src_y, dst_x, dst_y, width, height);
+}
+
+/* Blur pixmap by scaling it down a few times (every level halves the size),
+ * blurring the smallest image with the Gaussian kernel and scaling it back
+ * up level by level. Scaling is performed with the X Render bilinear filter,
+ * so the whole operation is done on the server side. Every pyramid level
+ * halves the standard deviation of the kernel applied to the smallest image,
+ * so the result approximates the full-size Gaussian blur, while the cost is
+ * a fraction of the full-size convolution. When the levels parameter is zero,
+ * two levels are used. */
+static int blur_xrender_scale(Display *display,
+        Visual *visual,
+        const Pixmap src_pm,
+        Pixmap dst_pm,
+        unsigned char blur,
+        unsigned int levels,
+        int src_x, int src_y,
+        int dst_x, int dst_y,
+        unsigned int width,
+        unsigned int height) {
+
+    XRenderPictFormat *format = XRenderFindVisualFormat(display, visual);
+    XRenderPictureAttributes pa = { .repeat = RepeatPad };
+    Pixmap pixmaps[BLUR_SCALE_LEVELS_MAX + 1];
+    Picture pictures[BLUR_SCALE_LEVELS_MAX + 1];
+    unsigned int widths[BLUR_SCALE_LEVELS_MAX + 1];
+    unsigned int heights[BLUR_SCALE_LEVELS_MAX + 1];
+    unsigned int i;
+
+    if (levels == 0)
+        levels = BLUR_SCALE_LEVELS_DEFAULT;
+    if (levels > BLUR_SCALE_LEVELS_MAX)
+        levels = BLUR_SCALE_LEVELS_MAX;
+    /* do not scale below a single pixel */
+    while (levels > 0 && (width >> levels == 0 || height >> levels == 0))
+        levels--;
+
+    debug("Blur pyramid levels: %u", levels);
+
+    /* level 0 is the source pixmap itself */
+    pixmaps[0] = src_pm;
+    pictures[0] = XRenderCreatePicture(display, src_pm, format, CPRepeat, &pa);
+    widths[0] = width;
+    heights[0] = height;
+
+    for (i = 1; i <= levels; i++) {
+        widths[i] = width >> i;
+        heights[i] = height >> i;
+        pixmaps[i] = XCreatePixmap(display, dst_pm, widths[i], heights[i], format->depth);
+        pictures[i] = XRenderCreatePicture(display, pixmaps[i], format, CPRepeat, &pa);
+        xrender_scale_picture(display,
+                pictures[i - 1], i == 1 ? src_x : 0, i == 1 ? src_y : 0,
+                widths[i - 1], heights[i - 1],
+                pictures[i], 0, 0, widths[i], heights[i], FilterBilinear);
+    }
+
+    { /* blur the smallest image, with the kernel scaled down accordingly */
+        Pixmap pm = XCreatePixmap(display, dst_pm, widths[levels], heights[levels], format->depth);
+        blur_xrender_gauss_sigma(display, visual, pixmaps[levels], pm,
+                blur_sigma(blur) / (1 << levels),
+                levels == 0 ? src_x : 0, levels == 0 ? src_y : 0,
+                0, 0, widths[levels], heights[levels]);
+        XRenderFreePicture(display, pictures[levels]);
+        if (levels > 0)
+            XFreePixmap(display, pixmaps[levels]);
+        pixmaps[levels] = pm;
+        pictures[levels] = XRenderCreatePicture(display, pm, format, CPRepeat, &pa);
+    }
+
+    if (levels == 0) {
+        /* nothing to scale, just copy the result */
+        Picture dst_pic = XRenderCreatePicture(display, dst_pm, format, 0, NULL);
+        XRenderComposite(display, PictOpSrc, pictures[0], None, dst_pic,
+                         0, 0, 0, 0, dst_x, dst_y, width, height);
+        XRenderFreePicture(display, dst_pic);
+        XRenderFreePicture(display, pictures[0]);
+        XFreePixmap(display, pixmaps[0]);
+        return 1;
+    }
+
+    /* scale up level by level, the last one into the destination */
+    for (i = levels; i > 0; i--) {
+        if (i == 1) {
+            Picture dst_pic = XRenderCreatePicture(display, dst_pm, format, 0, NULL);
+            xrender_scale_picture(display,
+                    pictures[1], 0, 0, widths[1], heights[1],
+                    dst_pic, dst_x, dst_y, width, height, FilterBilinear);
+            XRenderFreePicture(display, dst_pic);
+        }
+        else
+            xrender_scale_picture(display,
+                    pictures[i], 0, 0, widths[i], heights[i],
+                    pictures[i - 1], 0, 0, widths[i - 1], heights[i - 1], FilterBilinear);
+        XRenderFreePicture(display, pictures[i]);
+        XFreePixmap(display, pixmaps[i]);
+    }
+
+    XRenderFreePicture(display, pictures[0]);
+    return 1;
+}
+#endif /* ENABLE_XRENDER */
+
+/* Get the blur mode by its name. If the name is not recognized, -1 is
+ * returned. */
+int alock_blur_mode(const char *name) {
+    int i;
+    for (i = 0; i < ABLUR_MODE__MAX; i++)
+        if (strcmp(name, alock_blur_mode_names[i]) == 0)
+            return i;
+    return -1;
+}
+
+/* Get the width of the margin around the blurred area, which affects the
+ * result of the alock_blur_pixmap() called with the same parameters. */
+unsigned int alock_blur_margin(enum aBlurMode mode,
+        unsigned char blur,
+        unsigned int levels) {
+
+    if (!blur)
+        return 0;
+
+    /* The radius of the Gaussian kernel is the widest one. Radius of the
+     * Imlib2 blur and the sum of box blur radii are always smaller than this.
+     * In the scale mode, the (at least one pixel wide) kernel is applied to
+     * the smallest pyramid level, and every level extends the reach of the
+     * bilinear filter by one pixel on its own scale. */
+    if (mode == ABLUR_MODE_SCALE) {
+        if (levels == 0)
+            levels = BLUR_SCALE_LEVELS_DEFAULT;
+        if (levels > BLUR_SCALE_LEVELS_MAX)
+            levels = BLUR_SCALE_LEVELS_MAX;
+        return (blur_gauss_radius(blur_sigma(blur) / (1 << levels)) + 2) << levels;
+    }
+
+    return blur_gauss_radius(blur_sigma(blur)) + 1;
+}
+
+/* Blur given source pixmap by the amount specified by the blur parameter,
+ * which should be in range [0, 100], with the given algorithm. When the
+ * requested algorithm is not available, the default one is used. The levels
+ * parameter is the number of pyramid levels used by the scale algorithm,
+ * where zero stands for the default value. */
+int alock_blur_pixmap(Display *display,
+        Visual *visual,
+        const Pixmap src_pm,
+        Pixmap dst_pm,
+        enum aBlurMode mode,
+        unsigned char blur,
+        unsigned int levels,
+        int src_x, int src_y,
+        int dst_x, int dst_y,
+        unsigned int width,
+        unsigned int height) {
+
+    int (*func)(Display *, Visual *, const Pixmap, Pixmap, unsigned char,
+            int, int, int, int, unsigned int, unsigned int) = NULL;
+    const enum aBlurMode requested = mode;
+    unsigned long long t;
+    int rv;
+
+    if (!blur)
+        /* TODO: copy source pixmap to the destination one */
+        return 1;
+
+    switch (mode) {
+    case ABLUR_MODE_BOX:
+        func = blur_box;
+        break;
+#if ENABLE_IMLIB2
+    case ABLUR_MODE_IMLIB:
+        func = blur_imlib;
+        break;
+#endif
+#if ENABLE_XRENDER
+    case ABLUR_MODE_GAUSS2D:
+        func = blur_xrender_gauss2d;
+        break;
+    case ABLUR_MODE_GAUSS:
+        func = blur_xrender_gauss;
+        break;
+    case ABLUR_MODE_SCALE:
+        /* scale algorithm takes an extra parameter, so it is called
+         * directly, however it is available only with X Render */
+        func = blur_xrender_gauss;
+        break;
+#endif
+    default:
+        break;
+    }
+
+    if (func == NULL) {
+        /* Default (best available) algorithm. Prefer the X Render, which
+         * keeps pixels on the X server side. The Imlib2 blur has to read
+         * the whole drawable back to the client, so it is used only when
+         * it was requested explicitly. */
+#if ENABLE_XRENDER
+        mode = ABLUR_MODE_GAUSS;
+        func = blur_xrender_gauss;
 #else
-    (void)display;
-    (void)visual;
-    return 0;
+        mode = ABLUR_MODE_BOX;
+        func = blur_box;
+#endif
+    }
+
+    /* X server processes requests asynchronously, so in order to measure
+     * the blur time, we have to wait for the completion of all requests */
+    if (alock_trace_enabled())
+        XSync(display, False);
+    t = alock_utime();
+
+#if ENABLE_XRENDER
+    if (mode == ABLUR_MODE_SCALE)
+        rv = blur_xrender_scale(display, visual, src_pm, dst_pm, blur, levels,
+                src_x, src_y, dst_x, dst_y, width, height);
+    else
+#endif
+    rv = func(display, visual, src_pm, dst_pm, blur,
+            src_x, src_y, dst_x, dst_y, width, height);
+
+    if (alock_trace_enabled()) {
+        XSync(display, False);
+        alock_trace_span("blur", alock_blur_mode_names[mode], t,
+                "\"blur\":%u,\"width\":%u,\"height\":%u", blur, width, height);
+    }
+
+    /* Requested algorithm might not support given pixmap format (or the X
+     * server might lack required extension), so try the default one, and
+     * the box blur as the last resort. */
+    if (!rv && mode != ABLUR_MODE_BOX)
+        return alock_blur_pixmap(display, visual, src_pm, dst_pm,
+                requested != ABLUR_MODE_DEFAULT ? ABLUR_MODE_DEFAULT : ABLUR_MODE_BOX,
+                blur, levels, src_x, src_y, dst_x, dst_y, width, height);
+
+    return rv;
+}
+
+/* NOTE: Color conversion is based on the colorimetric strategy. The
+ *       principle is, that the luminance of the grayscale image should
+ *       match the luminance of the original color image. Luminance is
+ *       computed in the 8-bit fixed-point arithmetic, where coefficients
+ *       0.2126, 0.7152 and 0.0722 are approximated by 54, 183 and 19. */
+#define GRAYSCALE_R 54
+#define GRAYSCALE_G 183
+#define GRAYSCALE_B 19
+
+/* Layout of the color channel within the pixel value. */
+struct grayscaleChannel {
+    unsigned long mask;
+    int shift;
+    int width;
+};
+
+static void grayscale_channel(struct grayscaleChannel *ch, unsigned long mask) {
+    ch->mask = mask;
+    for (ch->shift = 0; mask && !(mask & 1); mask >>= 1)
+        ch->shift++;
+    for (ch->width = 0; mask & 1; mask >>= 1)
+        ch->width++;
+}
+
+static uint32_t grayscale_swap32(uint32_t v) {
+    return __builtin_bswap32(v);
+}
+
+static uint16_t grayscale_swap16(uint16_t v) {
+    return __builtin_bswap16(v);
+}
+
+/* Scalar kernel for arbitrary 16bpp and 32bpp true-color layouts, e.g. RGB
+ * 565 or 30-bit deep color. Channels are aligned to the widest one, so the
+ * precision of the deep color visuals is preserved. */
+static void grayscale_row_generic(char *row, unsigned int width, int bpp, int swap,
+        const struct grayscaleChannel *r,
+        const struct grayscaleChannel *g,
+        const struct grayscaleChannel *b) {
+
+    int w = r->width;
+    if (g->width > w)
+        w = g->width;
+    if (b->width > w)
+        w = b->width;
+
+    const unsigned long keep = ~(r->mask | g->mask | b->mask);
+    unsigned int i;
+
+    for (i = 0; i < width; i++) {
+
+        unsigned long value;
+        if (bpp == 32) {
+            uint32_t v;
+            memcpy(&v, row + i * 4, sizeof(v));
+            value = swap ? grayscale_swap32(v) : v;
+        }
+        else {
+            uint16_t v;
+            memcpy(&v, row + i * 2, sizeof(v));
+            value = swap ? grayscale_swap16(v) : v;
+        }
+
+        unsigned long y = (
+                GRAYSCALE_R * (((value & r->mask) >> r->shift) << (w - r->width)) +
+                GRAYSCALE_G * (((value & g->mask) >> g->shift) << (w - g->width)) +
+                GRAYSCALE_B * (((value & b->mask) >> b->shift) << (w - b->width))) >> 8;
+
+        value = (value & keep) |
+            (((y >> (w - r->width)) << r->shift) & r->mask) |
+            (((y >> (w - g->width)) << g->shift) & g->mask) |
+            (((y >> (w - b->width)) << b->shift) & b->mask);
+
+        if (bpp == 32) {
+            uint32_t v = swap ? grayscale_swap32(value) : value;
+            memcpy(row + i * 4, &v, sizeof(v));
+        }
+        else {
+            uint16_t v = swap ? grayscale_swap16(value) : value;
+            memcpy(row + i * 2, &v, sizeof(v));
+        }
+
+    }
+
+}
+
+/* Scalar kernel for the most common xRGB 8888 layout in the native byte
+ * order. It returns the number of processed pixels. */
+static unsigned int grayscale_row_xrgb(uint32_t *row, unsigned int width) {
+    unsigned int i;
+    for (i = 0; i < width; i++) {
+        uint32_t p = row[i];
+        uint32_t y = (GRAYSCALE_R * ((p >> 16) & 0xff) +
+                GRAYSCALE_G * ((p >> 8) & 0xff) +
+                GRAYSCALE_B * (p & 0xff)) >> 8;
+        row[i] = (p & 0xff000000) | (y << 16) | (y << 8) | y;
+    }
+    return width;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+
+/* SSE2 variant of the xRGB 8888 kernel. Every channel is multiplied in the
+ * lower 16-bit half of the 32-bit lane (the upper half is zero), and the sum
+ * of products fits in 16 bits, because coefficients sum up to 256. */
+__attribute__ ((target ("sse2")))
+static unsigned int grayscale_row_xrgb_sse2(uint32_t *row, unsigned int width) {
+
+    const __m128i mask = _mm_set1_epi32(0xff);
+    const __m128i alpha = _mm_set1_epi32(0xff000000);
+    const __m128i cr = _mm_set1_epi32(GRAYSCALE_R);
+    const __m128i cg = _mm_set1_epi32(GRAYSCALE_G);
+    const __m128i cb = _mm_set1_epi32(GRAYSCALE_B);
+    unsigned int i;
+
+    for (i = 0; i + 4 <= width; i += 4) {
+        __m128i p = _mm_loadu_si128((__m128i *)&row[i]);
+        __m128i y = _mm_add_epi16(_mm_add_epi16(
+                    _mm_mullo_epi16(_mm_and_si128(_mm_srli_epi32(p, 16), mask), cr),
+                    _mm_mullo_epi16(_mm_and_si128(_mm_srli_epi32(p, 8), mask), cg)),
+                _mm_mullo_epi16(_mm_and_si128(p, mask), cb));
+        y = _mm_srli_epi32(y, 8);
+        y = _mm_or_si128(_mm_or_si128(y, _mm_slli_epi32(y, 8)), _mm_slli_epi32(y, 16));
+        _mm_storeu_si128((__m128i *)&row[i], _mm_or_si128(_mm_and_si128(p, alpha), y));
+    }
+
+    return i + grayscale_row_xrgb(&row[i], width - i);
+}
+
+/* AVX2 variant of the xRGB 8888 kernel. */
+__attribute__ ((target ("avx2")))
+static unsigned int grayscale_row_xrgb_avx2(uint32_t *row, unsigned int width) {
+
+    const __m256i mask = _mm256_set1_epi32(0xff);
+    const __m256i alpha = _mm256_set1_epi32(0xff000000);
+    const __m256i cr = _mm256_set1_epi32(GRAYSCALE_R);
+    const __m256i cg = _mm256_set1_epi32(GRAYSCALE_G);
+    const __m256i cb = _mm256_set1_epi32(GRAYSCALE_B);
+    unsigned int i;
+
+    for (i = 0; i + 8 <= width; i += 8) {
+        __m256i p = _mm256_loadu_si256((__m256i *)&row[i]);
+        __m256i y = _mm256_add_epi16(_mm256_add_epi16(
+                    _mm256_mullo_epi16(_mm256_and_si256(_mm256_srli_epi32(p, 16), mask), cr),
+                    _mm256_mullo_epi16(_mm256_and_si256(_mm256_srli_epi32(p, 8), mask), cg)),
+                _mm256_mullo_epi16(_mm256_and_si256(p, mask), cb));
+        y = _mm256_srli_epi32(y, 8);
+        y = _mm256_or_si256(_mm256_or_si256(y, _mm256_slli_epi32(y, 8)), _mm256_slli_epi32(y, 16));
+        _mm256_storeu_si256((__m256i *)&row[i], _mm256_or_si256(_mm256_and_si256(p, alpha), y));
+    }
+
+    return i + grayscale_row_xrgb(&row[i], width - i);
+}
+
+#endif
+
+/* Select the fastest xRGB 8888 kernel supported by the running CPU. */
+static unsigned int (*grayscale_row_xrgb_kernel(void))(uint32_t *, unsigned int) {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return grayscale_row_xrgb_avx2;
+    if (__builtin_cpu_supports("sse2"))
+        return grayscale_row_xrgb_sse2;
 #endif
+    return grayscale_row_xrgb;
+}
+
+/* Convert given row band of the image - see alock_parallel_rows(). */
+static int grayscale_band(XImage *image, int x, int y,
+        unsigned int width, unsigned int height, void *arg) {
+
+    unsigned int (*xrgb_kernel)(uint32_t *, unsigned int) =
+        *(unsigned int (**)(uint32_t *, unsigned int))arg;
+    struct grayscaleChannel r, g, b;
+    int bpp = image->bits_per_pixel;
+    int swap = image->byte_order != alock_native_byte_order();
+    unsigned int _y;
+
+    grayscale_channel(&r, image->red_mask);
+    grayscale_channel(&g, image->green_mask);
+    grayscale_channel(&b, image->blue_mask);
+
+    const int xrgb = bpp == 32 && !swap &&
+        r.mask == 0xff0000 && g.mask == 0x00ff00 && b.mask == 0x0000ff;
+
+    for (_y = y; _y < y + height; _y++) {
+        char *row = image->data + _y * image->bytes_per_line + x * bpp / 8;
+        if (xrgb)
+            xrgb_kernel((uint32_t *)row, width);
+        else
+            grayscale_row_generic(row, width, bpp, swap, &r, &g, &b);
+    }
+
+    return 0;
 }
 
 /* Convert given color image to the grayscale intensity one. Note, that this
@@ -267,55 +1619,74 @@ int alock_grayscale_image(XImage *image,
         unsigned int width,
         unsigned int height) {
 
-    union {
-        struct __attribute__ ((packed)) {
-            uint16_t red   : 5;
-            uint16_t green : 6;
-            uint16_t blue  : 5;
-        } v16;
-        struct __attribute__ ((packed)) {
-            uint8_t red;
-            uint8_t green;
-            uint8_t blue;
-        } v24;
-        unsigned long value;
-    } pixel;
-
-    int depth = image->depth;
-    int _x, _y;
+    static unsigned int (*xrgb_kernel)(uint32_t *, unsigned int) = NULL;
+    int bpp = image->bits_per_pixel;
 
-    if (depth != 16 && depth != 24) {
-        fprintf(stderr, "alock: screen depth %d is not supported\n", depth);
+    if (image->format != ZPixmap || (bpp != 16 && bpp != 32) ||
+            !image->red_mask || !image->green_mask || !image->blue_mask) {
+        fprintf(stderr, "alock: screen depth %d is not supported\n", image->depth);
         return 0;
     }
 
-    /* NOTE: Color conversion is based on the colorimetric strategy. The
-     *       principle is, that the luminance of the grayscale image should
-     *       match the luminance of the original color image. */
-
-    for (_x = x; _x < (signed)width; _x++)
-        for (_y = y; _y < (signed)height; _y++) {
-            pixel.value = XGetPixel(image, _x, _y);
-
-            if (depth == 24)
-                pixel.v24.red = pixel.v24.green = pixel.v24.blue =
-                        0.2126 * pixel.v24.red +
-                        0.7152 * pixel.v24.green +
-                        0.0722 * pixel.v24.blue;
-            else {
-                pixel.v16.green =
-                        0.2126 * (pixel.v16.red << 1) +
-                        0.7152 * pixel.v16.green +
-                        0.0722 * (pixel.v16.blue << 1);
-                pixel.v16.red = pixel.v16.blue = pixel.v16.green >> 1;
-            }
+    /* clip given region to the image boundaries */
+    if (x < 0 || y < 0 || x >= image->width || y >= image->height)
+        return 1;
+    if (width > (unsigned)(image->width - x))
+        width = image->width - x;
+    if (height > (unsigned)(image->height - y))
+        height = image->height - y;
 
-            XPutPixel(image, _x, _y, pixel.value);
-        }
+    if (xrgb_kernel == NULL)
+        xrgb_kernel = grayscale_row_xrgb_kernel();
 
+    alock_parallel_rows(image, x, y, width, height, grayscale_band, &xrgb_kernel);
     return 1;
 }
 
+/* Convert the content of the given pixmap to the grayscale one. In contrast
+ * to the alock_grayscale_image(), the conversion is performed by the X server
+ * (with the X Render Extension HSL blend mode), so there is no need to fetch
+ * the image. This function returns 0 if such a conversion is not supported
+ * by the X server. */
+int alock_grayscale_pixmap(Display *display,
+        Visual *visual,
+        Pixmap pixmap,
+        int x, int y,
+        unsigned int width,
+        unsigned int height) {
+#if ENABLE_XRENDER && defined(PictOpHSLSaturation)
+
+    /* blend modes were introduced in the version 0.11 */
+    if (!alock_check_xrender_version(display, 0, 11))
+        return 0;
+
+    XRenderColor gray = { 0x8000, 0x8000, 0x8000, 0xffff };
+    XRenderPictFormat *format = XRenderFindVisualFormat(display, visual);
+    Picture src_pic = XRenderCreateSolidFill(display, &gray);
+    Picture dst_pic = XRenderCreatePicture(display, pixmap, format, 0, 0);
+
+    /* Take the saturation of the source (which is zero for gray color) and
+     * the hue and luminosity of the destination, which results in the
+     * luminosity-preserving desaturation. */
+    XRenderComposite(display, PictOpHSLSaturation, src_pic, None, dst_pic,
+            0, 0, 0, 0, x, y, width, height);
+
+    XRenderFreePicture(display, src_pic);
+    XRenderFreePicture(display, dst_pic);
+
+    return 1;
+#else
+    (void)display;
+    (void)visual;
+    (void)pixmap;
+    (void)x;
+    (void)y;
+    (void)width;
+    (void)height;
+    return 0;
+#endif /* ENABLE_XRENDER */
+}
+
 /* Dummy function for module interface. */
 void module_dummy_loadargs(const char *args) {
     (void)args;
@@ -339,3 +1710,16 @@ int module_dummy_init(Display *display) {
 void module_dummy_free(void) {
     debug("dummy free");
 }
+
+/* Dummy function for background module interface. */
+int module_dummy_capture(void) {
+    debug("dummy capture");
+    return 0;
+}
+
+/* Dummy function for background module interface. */
+int module_dummy_render(unsigned long deadline) {
+    (void)deadline;
+    debug("dummy render");
+    return 0;
+}
@@ -0,0 +1,344 @@
+/*
+ * alock - test-grayscale.c
+ * Copyright (c) 2014 - 2018 Arkadiusz Bokowy
+ *
+ * This file is a part of an alock.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ * Regression test for the client-side grayscale conversion. Every kernel
+ * (generic, xRGB scalar, SSE2 and AVX2) is compared with the reference
+ * implementation, which is based on the XGetPixel() and double-precision
+ * arithmetic, as the original per-pixel conversion was.
+ *
+ */
+
+#include "../src/trace.c"
+#include "../src/utils.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <X11/Xutil.h>
+
+#define WIDTH 67
+#define HEIGHT 13
+
+static int failures = 0;
+
+#define check(expr, M, ARGS ...) do { \
+        if (!(expr)) { \
+            fprintf(stderr, "%s:%d: %s: " M "\n", __FILE__, __LINE__, #expr, ## ARGS); \
+            failures++; \
+        } \
+    } while (0)
+
+/* Tested pixel format. */
+struct layout {
+    const char *name;
+    int depth;
+    int bpp;
+    unsigned long red_mask;
+    unsigned long green_mask;
+    unsigned long blue_mask;
+};
+
+static const struct layout layouts[] = {
+    { "RGB 565", 16, 16, 0xf800, 0x07e0, 0x001f },
+    { "BGR 565", 16, 16, 0x001f, 0x07e0, 0xf800 },
+    { "xRGB 8888", 24, 32, 0xff0000, 0x00ff00, 0x0000ff },
+    { "xBGR 8888", 24, 32, 0x0000ff, 0x00ff00, 0xff0000 },
+    { "xRGB 2101010", 30, 32, 0x3ff00000, 0x000ffc00, 0x000003ff },
+    { "xBGR 2101010", 30, 32, 0x000003ff, 0x000ffc00, 0x3ff00000 },
+};
+
+/* Deterministic pseudo-random generator, so failures are reproducible. */
+static unsigned long random_value(void) {
+    static unsigned long long seed = 0x2545f4914f6cdd1dULL;
+    seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    return seed >> 32;
+}
+
+static XImage *create_image(const struct layout *l, int byte_order) {
+
+    XImage *image = calloc(1, sizeof(*image));
+    int x, y;
+
+    image->width = WIDTH;
+    image->height = HEIGHT;
+    image->format = ZPixmap;
+    image->byte_order = byte_order;
+    image->bitmap_unit = 32;
+    image->bitmap_bit_order = MSBFirst;
+    image->bitmap_pad = 32;
+    /* The XGetPixel() masks out bits beyond the image depth, so in order to
+     * verify that padding bits are preserved, the depth is not reduced. */
+    image->depth = l->bpp;
+    image->bits_per_pixel = l->bpp;
+    image->bytes_per_line = (WIDTH * l->bpp / 8 + 3) & ~3;
+    image->red_mask = l->red_mask;
+    image->green_mask = l->green_mask;
+    image->blue_mask = l->blue_mask;
+    image->data = malloc(image->bytes_per_line * HEIGHT);
+
+    if (!XInitImage(image)) {
+        fprintf(stderr, "%s: unable to initialize image\n", l->name);
+        exit(EXIT_FAILURE);
+    }
+
+    /* Random pixels, including bits outside of color channels, which have
+     * to be preserved by the conversion. The first row contains primary
+     * colors, so the channel order is verified explicitly. */
+    for (y = 0; y < HEIGHT; y++)
+        for (x = 0; x < WIDTH; x++)
+            XPutPixel(image, x, y, random_value() & (l->bpp == 16 ? 0xffff : 0xffffffff));
+    XPutPixel(image, 0, 0, l->red_mask);
+    XPutPixel(image, 1, 0, l->green_mask);
+    XPutPixel(image, 2, 0, l->blue_mask);
+    XPutPixel(image, 3, 0, l->red_mask | l->green_mask | l->blue_mask);
+
+    return image;
+}
+
+static XImage *clone_image(const XImage *src) {
+    XImage *image = malloc(sizeof(*image));
+    memcpy(image, src, sizeof(*image));
+    image->data = malloc(image->bytes_per_line * image->height);
+    memcpy(image->data, src->data, image->bytes_per_line * image->height);
+    XInitImage(image);
+    return image;
+}
+
+static void free_image(XImage *image) {
+    free(image->data);
+    free(image);
+}
+
+/* Swap red and blue channels of every pixel. */
+static void swap_red_blue(XImage *image, const struct layout *l) {
+    struct grayscaleChannel r, b;
+    int x, y;
+    grayscale_channel(&r, l->red_mask);
+    grayscale_channel(&b, l->blue_mask);
+    for (y = 0; y < image->height; y++)
+        for (x = 0; x < image->width; x++) {
+            unsigned long p = XGetPixel(image, x, y);
+            unsigned long red = (p & r.mask) >> r.shift;
+            unsigned long blue = (p & b.mask) >> b.shift;
+            p &= ~(r.mask | b.mask);
+            XPutPixel(image, x, y, p | (red << b.shift) | (blue << r.shift));
+        }
+}
+
+/* Reference conversion based on the XGetPixel() and the double-precision
+ * arithmetic. Channels are aligned to the widest one - in the same way as
+ * the original 16-bit conversion did. */
+static void reference_grayscale(XImage *image, int x, int y,
+        unsigned int width, unsigned int height) {
+
+    struct grayscaleChannel r, g, b;
+    unsigned int _x, _y;
+    int w;
+
+    grayscale_channel(&r, image->red_mask);
+    grayscale_channel(&g, image->green_mask);
+    grayscale_channel(&b, image->blue_mask);
+
+    w = r.width;
+    if (g.width > w)
+        w = g.width;
+    if (b.width > w)
+        w = b.width;
+
+    for (_y = y; _y < y + height; _y++)
+        for (_x = x; _x < x + width; _x++) {
+
+            unsigned long p = XGetPixel(image, _x, _y);
+            unsigned long gray =
+                0.2126 * (((p & r.mask) >> r.shift) << (w - r.width)) +
+                0.7152 * (((p & g.mask) >> g.shift) << (w - g.width)) +
+                0.0722 * (((p & b.mask) >> b.shift) << (w - b.width));
+
+            p &= ~(r.mask | g.mask | b.mask);
+            p |= ((gray >> (w - r.width)) << r.shift) & r.mask;
+            p |= ((gray >> (w - g.width)) << g.shift) & g.mask;
+            p |= ((gray >> (w - b.width)) << b.shift) & b.mask;
+            XPutPixel(image, _x, _y, p);
+
+        }
+
+}
+
+/* The original (pre fixed-point) conversion - verbatim, except for the
+ * iteration over the image. It supports only 16 and 24-bit depths and its
+ * bit-field layout assumes the little-endian host. */
+static void legacy_grayscale(XImage *image, int depth) {
+
+    union {
+        struct __attribute__ ((packed)) {
+            uint16_t red   : 5;
+            uint16_t green : 6;
+            uint16_t blue  : 5;
+        } v16;
+        struct __attribute__ ((packed)) {
+            uint8_t red;
+            uint8_t green;
+            uint8_t blue;
+        } v24;
+        unsigned long value;
+    } pixel;
+
+    int _x, _y;
+
+    for (_x = 0; _x < image->width; _x++)
+        for (_y = 0; _y < image->height; _y++) {
+            pixel.value = XGetPixel(image, _x, _y);
+
+            if (depth == 24)
+                pixel.v24.red = pixel.v24.green = pixel.v24.blue =
+                        0.2126 * pixel.v24.red +
+                        0.7152 * pixel.v24.green +
+                        0.0722 * pixel.v24.blue;
+            else {
+                pixel.v16.green =
+                        0.2126 * (pixel.v16.red << 1) +
+                        0.7152 * pixel.v16.green +
+                        0.0722 * (pixel.v16.blue << 1);
+                pixel.v16.red = pixel.v16.blue = pixel.v16.green >> 1;
+            }
+
+            XPutPixel(image, _x, _y, pixel.value);
+        }
+
+}
+
+/* Compare images channel by channel. The fixed-point coefficients differ
+ * from the exact ones by less than 0.5%, so allow such an error on top of
+ * the rounding one. */
+static void compare_images(const char *name, XImage *image, XImage *expected) {
+
+    static const char *names[] = { "red", "green", "blue" };
+    struct grayscaleChannel ch[3];
+    int x, y, i;
+
+    grayscale_channel(&ch[0], image->red_mask);
+    grayscale_channel(&ch[1], image->green_mask);
+    grayscale_channel(&ch[2], image->blue_mask);
+    const unsigned long channels = ch[0].mask | ch[1].mask | ch[2].mask;
+
+    for (y = 0; y < image->height; y++)
+        for (x = 0; x < image->width; x++) {
+
+            unsigned long p1 = XGetPixel(image, x, y);
+            unsigned long p2 = XGetPixel(expected, x, y);
+
+            check((p1 & ~channels) == (p2 & ~channels),
+                    "%s: padding bits at %d,%d: %#lx != %#lx", name, x, y, p1, p2);
+
+            for (i = 0; i < 3; i++) {
+                long v1 = (p1 & ch[i].mask) >> ch[i].shift;
+                long v2 = (p2 & ch[i].mask) >> ch[i].shift;
+                long tolerance = 1 + ((1L << ch[i].width) - 1) * 5 / 1000;
+                check(labs(v1 - v2) <= tolerance,
+                        "%s: %s channel at %d,%d: %ld != %ld", name, names[i], x, y, v1, v2);
+            }
+
+        }
+
+}
+
+/* Run the row band function of the grayscale conversion with the given xRGB
+ * kernel, so every kernel can be tested regardless of the dispatching. */
+static void test_kernel(const struct layout *l, int byte_order, const char *kernel_name,
+        unsigned int (*kernel)(uint32_t *, unsigned int)) {
+
+    char name[64];
+    snprintf(name, sizeof(name), "%s %s %s", l->name,
+            byte_order == LSBFirst ? "LSB" : "MSB", kernel_name);
+
+    XImage *image = create_image(l, byte_order);
+    XImage *expected = clone_image(image);
+
+    grayscale_band(image, 0, 0, WIDTH, HEIGHT, &kernel);
+    reference_grayscale(expected, 0, 0, WIDTH, HEIGHT);
+    compare_images(name, image, expected);
+
+    free_image(image);
+    free_image(expected);
+}
+
+/* The public entry point has to convert only the given (clipped) region. */
+static void test_region(const struct layout *l, int byte_order) {
+
+    char name[64];
+    snprintf(name, sizeof(name), "%s %s region", l->name,
+            byte_order == LSBFirst ? "LSB" : "MSB");
+
+    XImage *image = create_image(l, byte_order);
+    XImage *expected = clone_image(image);
+
+    check(alock_grayscale_image(image, 5, 3, WIDTH, 4) == 1, "%s", name);
+    reference_grayscale(expected, 5, 3, WIDTH - 5, 4);
+    compare_images(name, image, expected);
+
+    free_image(image);
+    free_image(expected);
+}
+
+/* NOTE: The original conversion applied the coefficients to the channels
+ *       in the memory order of its bit-field layout, which for the common
+ *       RGB 565 and xRGB 8888 visuals is the reversed channel order, i.e.
+ *       the red coefficient was applied to the blue channel and vice versa.
+ *       The new kernels use the X visual masks, so the luminance of the red
+ *       and blue colors has changed. This is an intentional fix, which is
+ *       verified here explicitly: the original conversion shall be equal to
+ *       the reference one applied to the image with red and blue swapped. */
+static void test_legacy(const struct layout *l) {
+
+    XImage *image = create_image(l, LSBFirst);
+    XImage *expected = clone_image(image);
+
+    legacy_grayscale(image, l->depth);
+    swap_red_blue(expected, l);
+    reference_grayscale(expected, 0, 0, WIDTH, HEIGHT);
+    swap_red_blue(expected, l);
+
+    check(memcmp(image->data, expected->data, image->bytes_per_line * HEIGHT) == 0,
+            "%s: legacy conversion with swapped red and blue", l->name);
+
+    free_image(image);
+    free_image(expected);
+}
+
+int main(void) {
+
+    static const int byte_orders[] = { LSBFirst, MSBFirst };
+    unsigned int i, j;
+
+    for (i = 0; i < sizeof(layouts) / sizeof(*layouts); i++)
+        for (j = 0; j < sizeof(byte_orders) / sizeof(*byte_orders); j++) {
+            const struct layout *l = &layouts[i];
+            test_kernel(l, byte_orders[j], "scalar", grayscale_row_xrgb);
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("sse2"))
+                test_kernel(l, byte_orders[j], "sse2", grayscale_row_xrgb_sse2);
+            if (__builtin_cpu_supports("avx2"))
+                test_kernel(l, byte_orders[j], "avx2", grayscale_row_xrgb_avx2);
+#endif
+            test_region(l, byte_orders[j]);
+        }
+
+    if (alock_native_byte_order() == LSBFirst) {
+        test_legacy(&layouts[0]);
+        test_legacy(&layouts[2]);
+    }
+
+    if (failures) {
+        fprintf(stderr, "grayscale: %d check(s) failed\n", failures);
+        return EXIT_FAILURE;
+    }
+
+    printf("grayscale: all checks passed\n");
+    return EXIT_SUCCESS;
+}